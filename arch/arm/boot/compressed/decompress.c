@@ -1,5 +1,11 @@
 #define _LINUX_STRING_H_
 
+/*
+ * The boot loader may have left alignment checking enabled, so the
+ * decompressors must not rely on unaligned loads here.
+ */
+#undef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+
 #include <linux/compiler.h>	/* for inline */
 #include <linux/types.h>	/* for size_t */
 #include <linux/stddef.h>	/* for NULL */
@@ -0,0 +1,26 @@
+/*
+ * linux/arch/arm/include/asm/neon.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef __ASM_NEON_H
+#define __ASM_NEON_H
+
+#include <asm/hwcap.h>
+
+#define cpu_has_neon()		(!!(elf_hwcap & HWCAP_NEON))
+
+/*
+ * The NEON/VFP register file may only be used by the kernel between these
+ * two calls.  Preemption is disabled in between, and neither may be used
+ * from interrupt context.  The NEON code itself must live in a separate
+ * compilation unit (normally assembler) so that the compiler cannot move
+ * it outside of the pair.
+ */
+void kernel_neon_begin(void);
+void kernel_neon_end(void);
+
+#endif /* __ASM_NEON_H */
@@ -1,7 +1,17 @@
 #ifndef _ASM_ARM_UNALIGNED_H
 #define _ASM_ARM_UNALIGNED_H
 
+/*
+ * ARMv6 and later handle unaligned ldr/str/ldrh/strh in hardware, so let
+ * the compiler use them through packed structures.  Plain pointer casts
+ * (linux/unaligned/access_ok.h) are avoided as they may be turned into
+ * ldm/stm or ldrd/strd, which still trap on unaligned addresses.
+ */
+#if defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS) && !defined(__ARMEB__)
+#include <linux/unaligned/le_struct.h>
+#else
 #include <linux/unaligned/le_byteshift.h>
+#endif
 #include <linux/unaligned/be_byteshift.h>
 #include <linux/unaligned/generic.h>
 
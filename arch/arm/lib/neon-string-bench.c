@@ -0,0 +1,303 @@
+/*
+ *  linux/arch/arm/lib/neon-string-bench.c
+ *
+ *  Throughput of the NEON string routines against the integer ones.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * memcpy() and memset() switch to NEON at NEON_STRING_MIN bytes
+ * (neon-string.S), and neon-string-glue.c hands the NEON unit back every
+ * NEON_STRING_CHUNK bytes.  This module measures both choices on the
+ * running CPU:
+ *
+ *  - memcpy, memset and copy_page in MB/s for the __*_arm and __*_neon
+ *    routines, across request sizes and source/destination alignments.
+ *    Each NEON call pays for its own kernel_neon_begin()/end(), as in
+ *    the glue, so the size where NEON starts to win is the crossover
+ *    NEON_STRING_MIN should sit at.
+ *
+ *  - a BENCH_BUF_SIZE copy split into NEON sections of 1KB to 64KB,
+ *    giving the throughput and the longest section (during which
+ *    preemption is off) for each candidate NEON_STRING_CHUNK.
+ *
+ * Everything runs from module init, which then fails with -EAGAIN so
+ * that the module does not stay loaded:
+ *
+ *	modprobe neon-string-bench [msec=100] [hot=0]
+ */
+#define pr_fmt(fmt) "neon-string-bench: " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <asm/neon.h>
+#include <asm/page.h>
+
+/* Working set of a cold run; larger than the L2 of the parts we ship on. */
+#define BENCH_BUF_SIZE	(1024 * 1024)
+/* Slack after the buffer for the alignment offsets. */
+#define BENCH_BUF_PAD	64
+/* Calls made between two reads of the clock. */
+#define BENCH_BATCH	16
+
+extern void *__memcpy_arm(void *dest, const void *src, size_t n);
+extern void *__memset_arm(void *s, int c, size_t n);
+extern void __copy_page_arm(void *to, const void *from);
+
+extern void __memcpy_neon(void *dest, const void *src, size_t n);
+extern void __memset_neon(void *s, int c, size_t n);
+extern void __copy_page_neon(void *to, const void *from);
+
+static unsigned int msec = 100;
+static bool hot;
+
+static const size_t bench_sizes[] = {
+	64, 128, 256, 512, 768, 1024, 1536, 2048, 4096, 8192, 16384,
+};
+
+static const struct {
+	unsigned int dst;
+	unsigned int src;
+} bench_aligns[] = {
+	{ 0, 0 }, { 0, 1 }, { 0, 4 }, { 1, 0 }, { 4, 4 }, { 3, 1 },
+};
+
+static const size_t bench_chunks[] = {
+	1024, 2048, 4096, 8192, 16384, 32768, 65536,
+};
+
+typedef void (*bench_fn)(void *dst, const void *src, size_t len);
+
+static size_t bench_chunk;
+
+static void memcpy_int(void *dst, const void *src, size_t len)
+{
+	__memcpy_arm(dst, src, len);
+}
+
+static void memcpy_neon(void *dst, const void *src, size_t len)
+{
+	kernel_neon_begin();
+	__memcpy_neon(dst, src, len);
+	kernel_neon_end();
+}
+
+static void memcpy_neon_chunked(void *dst, const void *src, size_t len)
+{
+	while (len) {
+		size_t n = min(len, bench_chunk);
+
+		kernel_neon_begin();
+		__memcpy_neon(dst, src, n);
+		kernel_neon_end();
+
+		dst += n;
+		src += n;
+		len -= n;
+	}
+}
+
+static void memset_int(void *dst, const void *src, size_t len)
+{
+	__memset_arm(dst, 0x5a, len);
+}
+
+static void memset_neon(void *dst, const void *src, size_t len)
+{
+	kernel_neon_begin();
+	__memset_neon(dst, 0x5a, len);
+	kernel_neon_end();
+}
+
+static void copy_page_int(void *dst, const void *src, size_t len)
+{
+	__copy_page_arm(dst, src);
+}
+
+static void copy_page_neon(void *dst, const void *src, size_t len)
+{
+	kernel_neon_begin();
+	__copy_page_neon(dst, src);
+	kernel_neon_end();
+}
+
+/*
+ * Call fn on len-byte requests for msec milliseconds and return the rate
+ * in MB/s.  Unless hot is set, successive calls walk through the whole
+ * buffer so that the data comes from memory rather than the caches; the
+ * step is a multiple of 64 so the alignment of dst and src is kept.
+ */
+static unsigned long bench_mbps(bench_fn fn, void *dst, const void *src,
+				size_t len)
+{
+	size_t step = ALIGN(len, 64);
+	size_t span = hot ? step : BENCH_BUF_SIZE;
+	size_t off = 0;
+	u64 bytes = 0;
+	ktime_t start;
+	s64 ns;
+	int i;
+
+	fn(dst, src, len);
+
+	start = ktime_get();
+	do {
+		for (i = 0; i < BENCH_BATCH; i++) {
+			fn(dst + off, src + off, len);
+			off += step;
+			if (off + step > span)
+				off = 0;
+		}
+		bytes += BENCH_BATCH * len;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	} while (ns < (s64)msec * NSEC_PER_MSEC);
+
+	return div64_u64(bytes * 1000, ns);
+}
+
+static void bench_memcpy(void *dst, void *src)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+		for (j = 0; j < ARRAY_SIZE(bench_aligns); j++) {
+			void *d = dst + bench_aligns[j].dst;
+			void *s = src + bench_aligns[j].src;
+			size_t len = bench_sizes[i];
+
+			pr_info("memcpy %5zu bytes, dst+%u src+%u: int %5lu MB/s, neon %5lu MB/s\n",
+				len, bench_aligns[j].dst, bench_aligns[j].src,
+				bench_mbps(memcpy_int, d, s, len),
+				bench_mbps(memcpy_neon, d, s, len));
+			cond_resched();
+		}
+	}
+}
+
+static void bench_memset(void *dst)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+		for (j = 0; j < ARRAY_SIZE(bench_aligns); j++) {
+			void *d = dst + bench_aligns[j].dst;
+			size_t len = bench_sizes[i];
+
+			/* memset has no source; skip the repeated dst offsets. */
+			if (j && bench_aligns[j].dst == bench_aligns[j - 1].dst)
+				continue;
+
+			pr_info("memset %5zu bytes, dst+%u: int %5lu MB/s, neon %5lu MB/s\n",
+				len, bench_aligns[j].dst,
+				bench_mbps(memset_int, d, NULL, len),
+				bench_mbps(memset_neon, d, NULL, len));
+			cond_resched();
+		}
+	}
+}
+
+static void bench_copy_page(void *dst, void *src)
+{
+	pr_info("copy_page: int %5lu MB/s, neon %5lu MB/s\n",
+		bench_mbps(copy_page_int, dst, src, PAGE_SIZE),
+		bench_mbps(copy_page_neon, dst, src, PAGE_SIZE));
+}
+
+/* Longest single NEON section, in ns, when copying the whole buffer. */
+static s64 bench_chunk_max_ns(void *dst, const void *src)
+{
+	s64 ns, max_ns = 0;
+	size_t off;
+	ktime_t start;
+
+	for (off = 0; off < BENCH_BUF_SIZE; off += bench_chunk) {
+		start = ktime_get();
+		kernel_neon_begin();
+		__memcpy_neon(dst + off, src + off, bench_chunk);
+		kernel_neon_end();
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		if (ns > max_ns)
+			max_ns = ns;
+	}
+
+	return max_ns;
+}
+
+static void bench_chunks_run(void *dst, void *src)
+{
+	int i;
+
+	pr_info("memcpy %u bytes: int %5lu MB/s\n", BENCH_BUF_SIZE,
+		bench_mbps(memcpy_int, dst, src, BENCH_BUF_SIZE));
+
+	for (i = 0; i < ARRAY_SIZE(bench_chunks); i++) {
+		bench_chunk = bench_chunks[i];
+		pr_info("memcpy %u bytes, %5zu byte neon sections: %5lu MB/s, longest section %lld ns\n",
+			BENCH_BUF_SIZE, bench_chunk,
+			bench_mbps(memcpy_neon_chunked, dst, src,
+				   BENCH_BUF_SIZE),
+			bench_chunk_max_ns(dst, src));
+		cond_resched();
+	}
+}
+
+static int __init neon_string_bench_init(void)
+{
+	void *src, *dst;
+
+	if (!cpu_has_neon()) {
+		pr_err("no NEON unit\n");
+		return -ENODEV;
+	}
+
+	src = vmalloc(BENCH_BUF_SIZE + BENCH_BUF_PAD);
+	dst = vmalloc(BENCH_BUF_SIZE + BENCH_BUF_PAD);
+	if (!src || !dst) {
+		vfree(src);
+		vfree(dst);
+		return -ENOMEM;
+	}
+
+	memset(src, 0xa5, BENCH_BUF_SIZE + BENCH_BUF_PAD);
+	memset(dst, 0, BENCH_BUF_SIZE + BENCH_BUF_PAD);
+
+	pr_info("%u ms per figure, %s caches\n", msec, hot ? "hot" : "cold");
+
+	bench_memcpy(dst, src);
+	bench_memset(dst);
+	bench_copy_page(dst, src);
+	bench_chunks_run(dst, src);
+
+	vfree(src);
+	vfree(dst);
+
+	/*
+	 * All the work is done; fail the load so that the module does not
+	 * stay around, as crypto/tcrypt.c does.
+	 */
+	return -EAGAIN;
+}
+
+/*
+ * If an init function is provided, an exit function must also be provided
+ * to allow module unload.
+ */
+static void __exit neon_string_bench_exit(void) { }
+
+module_init(neon_string_bench_init);
+module_exit(neon_string_bench_exit);
+
+module_param(msec, uint, 0);
+MODULE_PARM_DESC(msec, "Milliseconds spent on each figure (default 100)");
+module_param(hot, bool, 0);
+MODULE_PARM_DESC(hot, "Reuse the same bytes on every call instead of "
+		      "walking a 1MB buffer");
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("NEON string routine benchmark");
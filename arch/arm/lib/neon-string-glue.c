@@ -0,0 +1,106 @@
+/*
+ *  linux/arch/arm/lib/neon-string-glue.c
+ *
+ *  Decide whether the NEON string routines in neon-string.S may be used.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/hardirq.h>
+#include <linux/irqflags.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <asm/neon.h>
+#include <asm/page.h>
+
+/*
+ * Upper bound on the bytes handled per kernel_neon_begin() section, so
+ * that a large copy does not hold off preemption for too long.
+ */
+#define NEON_STRING_CHUNK	(16 * 1024)
+
+extern void *__memcpy_arm(void *dest, const void *src, size_t n);
+extern void *__memset_arm(void *s, int c, size_t n);
+extern void __copy_page_arm(void *to, const void *from);
+
+extern void __memcpy_neon(void *dest, const void *src, size_t n);
+extern void __memset_neon(void *s, int c, size_t n);
+extern void __copy_page_neon(void *to, const void *from);
+
+#ifdef CONFIG_ARM_NEON_STRING_BENCH_MODULE
+/* For neon-string-bench.c, which times the two sets against each other. */
+EXPORT_SYMBOL_GPL(__memcpy_arm);
+EXPORT_SYMBOL_GPL(__memset_arm);
+EXPORT_SYMBOL_GPL(__copy_page_arm);
+EXPORT_SYMBOL_GPL(__memcpy_neon);
+EXPORT_SYMBOL_GPL(__memset_neon);
+EXPORT_SYMBOL_GPL(__copy_page_neon);
+#endif
+
+/*
+ * The VFP/NEON registers belong to user space and are switched lazily,
+ * so the kernel may only borrow them from process context.  Interrupt
+ * handlers and code running with interrupts off (early boot, suspend,
+ * CPU bring-up) keep using the integer routines.
+ */
+static inline bool neon_string_usable(void)
+{
+	return cpu_has_neon() && !in_interrupt() && !irqs_disabled();
+}
+
+void *__memcpy_large(void *dest, const void *src, size_t n)
+{
+	void *d = dest;
+
+	if (!neon_string_usable())
+		return __memcpy_arm(dest, src, n);
+
+	while (n) {
+		size_t len = min_t(size_t, n, NEON_STRING_CHUNK);
+
+		kernel_neon_begin();
+		__memcpy_neon(d, src, len);
+		kernel_neon_end();
+
+		d += len;
+		src += len;
+		n -= len;
+	}
+
+	return dest;
+}
+
+void *__memset_large(void *s, int c, size_t n)
+{
+	void *d = s;
+
+	if (!neon_string_usable())
+		return __memset_arm(s, c, n);
+
+	while (n) {
+		size_t len = min_t(size_t, n, NEON_STRING_CHUNK);
+
+		kernel_neon_begin();
+		__memset_neon(d, c, len);
+		kernel_neon_end();
+
+		d += len;
+		n -= len;
+	}
+
+	return s;
+}
+
+void copy_page(void *to, const void *from)
+{
+	if (!neon_string_usable()) {
+		__copy_page_arm(to, from);
+		return;
+	}
+
+	kernel_neon_begin();
+	__copy_page_neon(to, from);
+	kernel_neon_end();
+}
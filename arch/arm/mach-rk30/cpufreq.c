@@ -34,6 +34,8 @@
 #include <asm/uaccess.h>
 #include <mach/ddr.h>
 #include <linux/cpu.h>
+#include <linux/math64.h>
+#include <trace/events/power.h>
 #ifdef DEBUG
 #define FREQ_PRINTK_DBG(fmt, args...) pr_debug(fmt, ## args)
 #define FREQ_PRINTK_LOG(fmt, args...) pr_debug(fmt, ## args)
@@ -79,6 +81,51 @@ static struct clk *ddr_clk;
 
 static int cpufreq_scale_rate_for_dvfs(struct clk *clk, unsigned long rate, dvfs_set_rate_callback set_rate);
 
+/*
+ * The screen-off cap and the thermal controller both bound the gpu rate.
+ * Each source keeps its own window (kHz, max_khz == 0 when unset) and the
+ * intersection of the set ones is what dvfs gets, so neither can undo the
+ * other.
+ */
+enum {
+	GPU_LIMIT_SUSPEND,
+	GPU_LIMIT_THERMAL,
+	GPU_NR_LIMITS,
+};
+
+static struct {
+	unsigned int min_khz;
+	unsigned int max_khz;
+} gpu_limits[GPU_NR_LIMITS];
+
+static DEFINE_MUTEX(gpu_limit_mutex);
+
+static void rk30_gpu_set_limit(int id, unsigned int min_khz, unsigned int max_khz)
+{
+	unsigned int lo = 0, hi = 0;
+	int i;
+
+	if (IS_ERR_OR_NULL(gpu_clk))
+		return;
+
+	mutex_lock(&gpu_limit_mutex);
+	gpu_limits[id].min_khz = min_khz;
+	gpu_limits[id].max_khz = max_khz;
+
+	for (i = 0; i < GPU_NR_LIMITS; i++) {
+		if (!gpu_limits[i].max_khz)
+			continue;
+		lo = lo ? min(lo, gpu_limits[i].min_khz) : gpu_limits[i].min_khz;
+		hi = hi ? min(hi, gpu_limits[i].max_khz) : gpu_limits[i].max_khz;
+	}
+
+	if (hi)
+		dvfs_clk_enable_limit(gpu_clk, lo * 1000, hi * 1000);
+	else
+		dvfs_clk_disable_limit(gpu_clk);
+	mutex_unlock(&gpu_limit_mutex);
+}
+
 /*******************************************************/
 static unsigned int rk30_getspeed(unsigned int cpu)
 {
@@ -114,6 +161,9 @@ module_param(temp_limt_freq, uint, 0444);
 
 #define TEMP_LIMIT_FREQ 816000
 
+/* Last frequency the governor asked for, before any thermal limit */
+static unsigned int ondemand_target = TEMP_LIMIT_FREQ;
+
 static const struct cpufreq_frequency_table temp_limits[] = {
 	{.frequency = 1416 * 1000, .index = 50},
 	{.frequency = 1200 * 1000, .index = 55},
@@ -127,19 +177,304 @@ static const struct cpufreq_frequency_table temp_limits_high[] = {
 
 extern int rk30_tsadc_get_temp(unsigned int chn);
 
-static void rk30_cpufreq_temp_limit_work_func(struct work_struct *work)
+static void rk30_cpufreq_set_temp_limit(unsigned int new)
 {
 	struct cpufreq_policy *policy;
-	int temp, i;
+
+	if (temp_limt_freq == new)
+		return;
+
+	temp_limt_freq = new;
+	FREQ_PRINTK_DBG("temp_limit set rate %d kHz\n", temp_limt_freq);
+	policy = cpufreq_cpu_get(0);
+	if (!policy)
+		return;
+	cpufreq_driver_target(policy, policy->cur, CPUFREQ_RELATION_L | CPUFREQ_PRIVATE);
+	cpufreq_cpu_put(policy);
+}
+
+/*
+ * Closed-loop thermal control.
+ *
+ * Every thermal_pid_period_ms the distance to thermal_target_temp is fed
+ * through a PID controller whose output is a power budget in mW:
+ *
+ *   budget = sustainable_power + kp * err + ki * sum(err) + kd * d(err)
+ *
+ * The budget is shared among the cpu, gpu and ddr clocks in proportion to
+ * the power each of them currently asks for, and each share is turned back
+ * into the highest rate of that clock's dvfs table that fits, using
+ * P = coeff * f * V^2 with coeff in uW/(MHz*V^2). The cpu share becomes
+ * temp_limt_freq, the gpu and ddr shares become dvfs rate limits.
+ *
+ * Unlike the step tables below, the granted rate settles where the heat
+ * produced matches what the device can dissipate instead of bouncing
+ * between max_freq and the cap. Setting thermal_pid=0 falls back to the
+ * tables.
+ */
+static bool thermal_pid = true;
+module_param(thermal_pid, bool, 0644);
+
+static int thermal_target_temp = 75;		/* degree C */
+module_param(thermal_target_temp, int, 0644);
+
+static unsigned int thermal_sustainable_power = 2000;	/* mW */
+module_param(thermal_sustainable_power, uint, 0644);
+
+static int thermal_pid_kp = 100;		/* mW / degree C */
+module_param(thermal_pid_kp, int, 0644);
+
+static int thermal_pid_ki = 10;			/* mW / (degree C * period) */
+module_param(thermal_pid_ki, int, 0644);
+
+static int thermal_pid_kd = 50;			/* mW * period / degree C */
+module_param(thermal_pid_kd, int, 0644);
+
+/* Only integrate close to the target, and bound the integral term (mW) */
+static int thermal_pid_integral_cutoff = 10;	/* degree C */
+module_param(thermal_pid_integral_cutoff, int, 0644);
+
+static int thermal_pid_integral_max = 1000;	/* mW */
+module_param(thermal_pid_integral_max, int, 0644);
+
+static unsigned int thermal_pid_period_ms = 100;
+module_param(thermal_pid_period_ms, uint, 0644);
+
+static unsigned int thermal_cpu_coeff = 400;	/* per online core */
+module_param(thermal_cpu_coeff, uint, 0644);
+
+static unsigned int thermal_gpu_coeff = 600;
+module_param(thermal_gpu_coeff, uint, 0644);
+
+static unsigned int thermal_ddr_coeff = 300;
+module_param(thermal_ddr_coeff, uint, 0644);
+
+/* Lowest ddr rate (kHz) the controller may impose, to keep display/video fed */
+static unsigned int thermal_ddr_floor = 300 * 1000;
+module_param(thermal_ddr_floor, uint, 0644);
+
+enum {
+	THERMAL_ACTOR_CPU,
+	THERMAL_ACTOR_GPU,
+	THERMAL_ACTOR_DDR,
+	THERMAL_NR_ACTORS,
+};
+
+struct rk30_thermal_actor {
+	struct clk *clk;
+	struct cpufreq_frequency_table *table;
+	unsigned int *coeff;
+	unsigned int min_freq;		/* kHz, range the limit may move in */
+	unsigned int max_freq;
+	unsigned int req_freq;		/* kHz, what the clock currently wants */
+	unsigned int granted_freq;	/* kHz, limit currently applied */
+};
+
+static struct rk30_thermal_actor thermal_actors[THERMAL_NR_ACTORS];
+
+static struct {
+	int integral;
+	int last_err;
+	bool active;
+} thermal_pid_state;
+
+static unsigned int rk30_thermal_power(struct rk30_thermal_actor *actor, unsigned int khz)
+{
+	unsigned int mv = 0;
+	u64 power;
+	int i;
+
+	/* voltage of the lowest table entry that can run at this rate */
+	for (i = 0; actor->table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		mv = actor->table[i].index / 1000;
+		if (actor->table[i].frequency >= khz)
+			break;
+	}
+
+	power = (u64)*actor->coeff * (khz / 1000) * mv * mv;
+	if (actor == &thermal_actors[THERMAL_ACTOR_CPU])
+		power *= num_online_cpus();
+
+	return div_u64(power, 1000000000);
+}
+
+static unsigned int rk30_thermal_power_to_freq(struct rk30_thermal_actor *actor, unsigned int power)
+{
+	unsigned int freq = actor->min_freq;
+	int i;
+
+	for (i = 0; actor->table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		unsigned int f = actor->table[i].frequency;
+
+		if (f > freq && f <= actor->max_freq && rk30_thermal_power(actor, f) <= power)
+			freq = f;
+	}
+
+	return freq;
+}
+
+static void rk30_thermal_actor_init(int id, struct clk *clk, unsigned int *coeff,
+				    unsigned int min_freq, unsigned int max_freq)
+{
+	struct rk30_thermal_actor *actor = &thermal_actors[id];
+	int i;
+
+	if (IS_ERR_OR_NULL(clk))
+		return;
+
+	actor->table = dvfs_get_freq_volt_table(clk);
+	if (!actor->table)
+		return;
+
+	if (!min_freq || !max_freq) {
+		min_freq = -1;
+		max_freq = 0;
+		for (i = 0; actor->table[i].frequency != CPUFREQ_TABLE_END; i++) {
+			min_freq = min(min_freq, actor->table[i].frequency);
+			max_freq = max(max_freq, actor->table[i].frequency);
+		}
+		if (!max_freq)
+			return;
+	}
+
+	actor->clk = clk;
+	actor->coeff = coeff;
+	actor->min_freq = min_freq;
+	actor->max_freq = max_freq;
+	actor->granted_freq = max_freq;
+}
+
+static void rk30_thermal_actors_init(void)
+{
+	rk30_thermal_actor_init(THERMAL_ACTOR_CPU, cpu_clk, &thermal_cpu_coeff, 0, 0);
+	/* same window as the static gpu limit set up in rk30_cpu_init() */
+	rk30_thermal_actor_init(THERMAL_ACTOR_GPU, gpu_clk, &thermal_gpu_coeff,
+				133 * 1000, 400 * 1000);
+	rk30_thermal_actor_init(THERMAL_ACTOR_DDR, ddr_clk, &thermal_ddr_coeff, 0, 0);
+}
+
+static void rk30_thermal_actor_limit(struct rk30_thermal_actor *actor, unsigned int freq)
+{
+	if (actor->granted_freq == freq)
+		return;
+
+	actor->granted_freq = freq;
+	if (actor == &thermal_actors[THERMAL_ACTOR_CPU])
+		rk30_cpufreq_set_temp_limit(freq >= actor->max_freq ? -1 : freq);
+	else if (actor == &thermal_actors[THERMAL_ACTOR_GPU])
+		rk30_gpu_set_limit(GPU_LIMIT_THERMAL, actor->min_freq, freq);
+	else
+		dvfs_clk_enable_limit(actor->clk, actor->min_freq * 1000, freq * 1000);
+}
+
+/* Hand every clock its full range back */
+static void rk30_thermal_pid_release(void)
+{
+	int i;
+
+	if (!thermal_pid_state.active)
+		return;
+
+	/*
+	 * May run from the policy notifier with the policy lock held, so the
+	 * cpu limit is only dropped here; the governor picks it up on its
+	 * next sample.
+	 */
+	thermal_actors[THERMAL_ACTOR_CPU].granted_freq = thermal_actors[THERMAL_ACTOR_CPU].max_freq;
+	temp_limt_freq = -1;
+
+	for (i = THERMAL_ACTOR_GPU; i < THERMAL_NR_ACTORS; i++) {
+		if (thermal_actors[i].clk)
+			rk30_thermal_actor_limit(&thermal_actors[i], thermal_actors[i].max_freq);
+	}
+	thermal_pid_state.integral = 0;
+	thermal_pid_state.last_err = 0;
+	thermal_pid_state.active = false;
+}
+
+static unsigned long rk30_thermal_pid_update(int temp)
+{
+	struct rk30_thermal_actor *actor;
+	unsigned int req_power[THERMAL_NR_ACTORS] = { 0 };
+	unsigned int total_req = 0, budget;
+	int err, i_term, budget_signed, i;
+	u64 share;
+
+	err = thermal_target_temp - temp;
+	if (!thermal_pid_state.active) {
+		thermal_pid_state.last_err = err;
+		thermal_pid_state.active = true;
+	}
+
+	if (abs(err) < thermal_pid_integral_cutoff) {
+		thermal_pid_state.integral += err;
+		i_term = thermal_pid_ki * thermal_pid_state.integral;
+		if (thermal_pid_ki && abs(i_term) > thermal_pid_integral_max) {
+			thermal_pid_state.integral = (i_term > 0 ? 1 : -1) *
+				thermal_pid_integral_max / thermal_pid_ki;
+		}
+	}
+	i_term = thermal_pid_ki * thermal_pid_state.integral;
+
+	budget_signed = thermal_sustainable_power + thermal_pid_kp * err + i_term +
+		thermal_pid_kd * (err - thermal_pid_state.last_err);
+	thermal_pid_state.last_err = err;
+	budget = max(budget_signed, 0);
+
+	/* What would every clock burn if it ran at the rate it asks for? */
+	for (i = 0; i < THERMAL_NR_ACTORS; i++) {
+		actor = &thermal_actors[i];
+		if (!actor->clk)
+			continue;
+
+		if (i == THERMAL_ACTOR_CPU)
+			actor->req_freq = ondemand_target;
+		else
+			actor->req_freq = clk_get_rate(actor->clk) / 1000;
+		/* a clock held at its limit may want more than it gets */
+		if (actor->req_freq >= actor->granted_freq && actor->granted_freq < actor->max_freq)
+			actor->req_freq = actor->max_freq;
+
+		req_power[i] = rk30_thermal_power(actor, actor->req_freq);
+		total_req += req_power[i];
+	}
+
+	for (i = 0; i < THERMAL_NR_ACTORS; i++) {
+		unsigned int freq;
+
+		actor = &thermal_actors[i];
+		if (!actor->clk)
+			continue;
+
+		if (!total_req) {
+			freq = actor->max_freq;
+		} else {
+			share = (u64)budget * req_power[i];
+			freq = rk30_thermal_power_to_freq(actor, div_u64(share, total_req));
+		}
+		if (i == THERMAL_ACTOR_DDR)
+			freq = max(freq, min(thermal_ddr_floor, actor->max_freq));
+
+		rk30_thermal_actor_limit(actor, freq);
+	}
+
+	trace_thermal_power_allocate(temp, thermal_target_temp, budget,
+				     thermal_actors[THERMAL_ACTOR_CPU].granted_freq,
+				     thermal_actors[THERMAL_ACTOR_GPU].granted_freq,
+				     thermal_actors[THERMAL_ACTOR_DDR].granted_freq);
+
+	return msecs_to_jiffies(thermal_pid_period_ms ? : 100);
+}
+
+static unsigned long rk30_cpufreq_temp_limit_table(int temp, unsigned int gpu_irqs_start)
+{
+	int i;
 	unsigned int new = -1;
 	unsigned long delay = HZ;
 	const struct cpufreq_frequency_table *limits_table = temp_limits;
 	size_t limits_size = ARRAY_SIZE(temp_limits);
 	unsigned int gpu_irqs[2];
-	gpu_irqs[0] = kstat_irqs(IRQ_GPU_GP);
-
-	temp = rk30_tsadc_get_temp(0);
-	FREQ_PRINTK_LOG("cpu_thermal(%d)\n", temp);
+	gpu_irqs[0] = gpu_irqs_start;
 
 	gpu_irqs[1] = kstat_irqs(IRQ_GPU_GP);
 	if (clk_get_rate(gpu_clk) > GPU_MAX_RATE) {
@@ -154,12 +489,25 @@ static void rk30_cpufreq_temp_limit_work_func(struct work_struct *work)
 			new = limits_table[i].frequency;
 		}
 	}
-	if (temp_limt_freq != new) {
-		temp_limt_freq = new;
-		FREQ_PRINTK_DBG("temp_limit set rate %d kHz\n", temp_limt_freq);
-		policy = cpufreq_cpu_get(0);
-		cpufreq_driver_target(policy, policy->cur, CPUFREQ_RELATION_L | CPUFREQ_PRIVATE);
-		cpufreq_cpu_put(policy);
+	rk30_cpufreq_set_temp_limit(new);
+
+	return delay;
+}
+
+static void rk30_cpufreq_temp_limit_work_func(struct work_struct *work)
+{
+	int temp;
+	unsigned long delay;
+	unsigned int gpu_irqs = kstat_irqs(IRQ_GPU_GP);
+
+	temp = rk30_tsadc_get_temp(0);
+	FREQ_PRINTK_LOG("cpu_thermal(%d)\n", temp);
+
+	if (thermal_pid) {
+		delay = rk30_thermal_pid_update(temp);
+	} else {
+		rk30_thermal_pid_release();
+		delay = rk30_cpufreq_temp_limit_table(temp, gpu_irqs);
 	}
 
 	queue_delayed_work(freq_wq, &rk30_cpufreq_temp_limit_work, delay);
@@ -179,6 +527,7 @@ static int rk30_cpufreq_notifier_policy(struct notifier_block *nb,
 	} else {
 		FREQ_PRINTK_DBG("cancel work\n");
 		cancel_delayed_work_sync(&rk30_cpufreq_temp_limit_work);
+		rk30_thermal_pid_release();
 	}
 
 	return 0;
@@ -279,6 +628,7 @@ static int rk30_cpu_init(struct cpufreq_policy *policy)
 
 		freq_wq = create_singlethread_workqueue("rk30_cpufreqd");
 #ifdef CONFIG_RK30_CPU_FREQ_LIMIT_BY_TEMP
+		rk30_thermal_actors_init();
 		if (rk30_cpufreq_is_ondemand_policy(policy)) {
 			queue_delayed_work(freq_wq, &rk30_cpufreq_temp_limit_work, 0*HZ);
 		}
@@ -452,8 +802,7 @@ static void ff_early_suspend_func(struct early_suspend *h)
 		
 		clk_disable_dvfs(cpu_clk);
 	}	
-	if (!IS_ERR(gpu_clk))
-		dvfs_clk_enable_limit(gpu_clk,75*1000*1000,133*1000*1000);
+	rk30_gpu_set_limit(GPU_LIMIT_SUSPEND, 75 * 1000, 133 * 1000);
 	
 	//ff_scale_votlage("vdd_cpu", 1000000);
 	//ff_scale_votlage("vdd_core", 1000000);
@@ -474,8 +823,8 @@ static void ff_early_resume_func(struct early_suspend *h)
 		clk_enable_dvfs(cpu_clk);
 	}	
 	
-	if (!IS_ERR(gpu_clk))
-		dvfs_clk_disable_limit(gpu_clk);
+	/* drops only the screen-off cap, a thermal limit stays in force */
+	rk30_gpu_set_limit(GPU_LIMIT_SUSPEND, 0, 0);
 #ifdef CONFIG_HOTPLUG_CPU
 	cpu_up(1);
 #endif
@@ -546,13 +895,10 @@ static unsigned int cpufreq_scale_limt(unsigned int target_freq, struct cpufreq_
 #endif
 
 #ifdef CONFIG_RK30_CPU_FREQ_LIMIT_BY_TEMP
-	{
-		static unsigned int ondemand_target = TEMP_LIMIT_FREQ;
-		if (is_private)
-			target_freq = ondemand_target;
-		else
-			ondemand_target = target_freq;
-	}
+	if (is_private)
+		target_freq = ondemand_target;
+	else
+		ondemand_target = target_freq;
 
 	if (target_freq != policy->max && target_freq > policy->cur && policy->cur >= TEMP_LIMIT_FREQ) {
 		if (cpufreq_frequency_table_target(policy, freq_table, policy->cur + 1, CPUFREQ_RELATION_L, &i) == 0) {
@@ -714,11 +1060,21 @@ static struct notifier_block rk30_cpufreq_reboot_notifier = {
 	.notifier_call = rk30_cpufreq_reboot_notifier_event,
 };
 
+static unsigned int rk30_cpufreq_get_limit(struct cpufreq_policy *policy)
+{
+#ifdef CONFIG_RK30_CPU_FREQ_LIMIT_BY_TEMP
+	if (rk30_cpufreq_is_ondemand_policy(policy))
+		return temp_limt_freq;
+#endif
+	return policy->max;
+}
+
 static struct cpufreq_driver rk30_cpufreq_driver = {
 	.flags = CPUFREQ_CONST_LOOPS,
 	.verify = rk30_verify_speed,
 	.target = rk30_target,
 	.get = rk30_getspeed,
+	.get_limit = rk30_cpufreq_get_limit,
 	.init = rk30_cpu_init,
 	.exit = rk30_cpu_exit,
 	.name = "rk30",
@@ -12,10 +12,46 @@
 #include <linux/cpuidle.h>
 #include <linux/suspend.h>
 #include <linux/err.h>
+#include <linux/clockchips.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
 
 #include <asm/hardware/gic.h>
 #include <asm/io.h>
 
+#include <mach/cru.h>
+
+#define cru_readl(offset)	readl_relaxed(RK30_CRU_BASE + offset)
+#define cru_writel(v, offset)	do { writel_relaxed(v, RK30_CRU_BASE + offset); dsb(); } while (0)
+
+/* Core clock divider used while in the cluster state */
+#define RK30_IDLE_CORE_DIV	16
+
+enum rk30_idle_state {
+	RK30_STATE_C1,
+	RK30_STATE_C2,
+	RK30_NR_STATES,
+};
+
+/*
+ * Per-state statistics, on top of the usage and time counters the cpuidle
+ * core already exports in sysfs. 'exit' is the time from the wakeup
+ * interrupt being seen to the state being fully left, so that the
+ * exit_latency of the state table can be checked against real hardware.
+ */
+struct rk30_idle_stats {
+	unsigned long entries;
+	unsigned long demoted;
+	u64 residency_us;
+	u64 exit_ns;
+	u64 exit_max_ns;
+};
+
+static DEFINE_PER_CPU(struct rk30_idle_stats [RK30_NR_STATES], rk30_idle_stats);
+
 static bool rk30_gic_interrupt_pending(void)
 {
 	return (readl_relaxed(RK30_GICC_BASE + GIC_CPU_HIGHPRI) != 0x3FF);
@@ -30,6 +66,19 @@ retry:
 		goto retry;
 }
 
+static void rk30_idle_account(struct cpuidle_device *dev, int state,
+			      ktime_t preidle, ktime_t wake, ktime_t postidle)
+{
+	struct rk30_idle_stats *st = &per_cpu(rk30_idle_stats, dev->cpu)[state];
+	u64 exit_ns = ktime_to_ns(ktime_sub(postidle, wake));
+
+	st->entries++;
+	st->residency_us += ktime_to_us(ktime_sub(postidle, preidle));
+	st->exit_ns += exit_ns;
+	if (exit_ns > st->exit_max_ns)
+		st->exit_max_ns = exit_ns;
+}
+
 static int rk30_idle(struct cpuidle_device *dev, struct cpuidle_state *state)
 {
 	ktime_t preidle, postidle;
@@ -45,13 +94,70 @@ static int rk30_idle(struct cpuidle_device *dev, struct cpuidle_state *state)
 	local_fiq_enable();
 	local_irq_enable();
 
+	rk30_idle_account(dev, RK30_STATE_C1, preidle, postidle, postidle);
+
+	return ktime_to_us(ktime_sub(postidle, preidle));
+}
+
+/*
+ * C2: cluster idle.
+ *
+ * Only usable by the last online core, once the other cores have been
+ * powered down through the hotplug path. The core clock is divided down
+ * for the duration of WFI. The local timer runs from the core clock, so
+ * timer events are handed to the broadcast timer meanwhile. If other
+ * cores are online, this falls back to C1.
+ */
+static int rk30_idle_cluster(struct cpuidle_device *dev,
+			     struct cpuidle_state *state)
+{
+	ktime_t preidle, wake, postidle;
+	u32 clksel0;
+	int cpu = dev->cpu;
+
+	if (num_online_cpus() > 1) {
+		per_cpu(rk30_idle_stats, cpu)[RK30_STATE_C2].demoted++;
+		dev->last_state = &dev->states[RK30_STATE_C1];
+		return rk30_idle(dev, &dev->states[RK30_STATE_C1]);
+	}
+
+	local_fiq_disable();
+
+	preidle = ktime_get();
+
+	clockevents_notify(CLOCK_EVT_NOTIFY_BROADCAST_ENTER, &cpu);
+
+	clksel0 = cru_readl(CRU_CLKSELS_CON(0));
+	cru_writel(CORE_CLK_DIV_W_MSK | CORE_CLK_DIV(RK30_IDLE_CORE_DIV),
+		   CRU_CLKSELS_CON(0));
+
+	rk30_wfi_until_interrupt();
+
+	wake = ktime_get();
+
+	cru_writel(CORE_CLK_DIV_W_MSK | (clksel0 & CORE_CLK_DIV_MSK),
+		   CRU_CLKSELS_CON(0));
+
+	clockevents_notify(CLOCK_EVT_NOTIFY_BROADCAST_EXIT, &cpu);
+
+	postidle = ktime_get();
+
+	local_fiq_enable();
+	local_irq_enable();
+
+	rk30_idle_account(dev, RK30_STATE_C2, preidle, wake, postidle);
+
 	return ktime_to_us(ktime_sub(postidle, preidle));
 }
 
 static DEFINE_PER_CPU(struct cpuidle_device, rk30_cpuidle_device);
 
+/*
+ * C2 latencies cover the divider switch and the broadcast timer handover.
+ * They are kept conservative; compare with the exit times in debugfs.
+ */
 static __initdata struct cpuidle_state rk30_cpuidle_states[] = {
-	{
+	[RK30_STATE_C1] = {
 		.name = "C1",
 		.desc = "idle",
 		.flags = CPUIDLE_FLAG_TIME_VALID,
@@ -59,6 +165,14 @@ static __initdata struct cpuidle_state rk30_cpuidle_states[] = {
 		.target_residency = 0,
 		.enter = rk30_idle,
 	},
+	[RK30_STATE_C2] = {
+		.name = "C2",
+		.desc = "cluster idle, core clock divided",
+		.flags = CPUIDLE_FLAG_TIME_VALID,
+		.exit_latency = 40,
+		.target_residency = 400,
+		.enter = rk30_idle_cluster,
+	},
 };
 
 static struct cpuidle_driver rk30_cpuidle_driver = {
@@ -66,6 +180,40 @@ static struct cpuidle_driver rk30_cpuidle_driver = {
 	.owner = THIS_MODULE,
 };
 
+static int rk30_cpuidle_stats_show(struct seq_file *m, void *unused)
+{
+	unsigned int cpu;
+	int i;
+
+	seq_printf(m, "cpu state   entries   demoted  residency_us   avg_exit_ns   max_exit_ns\n");
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < RK30_NR_STATES; i++) {
+			struct rk30_idle_stats *st = &per_cpu(rk30_idle_stats, cpu)[i];
+			u64 avg = st->entries ? div64_u64(st->exit_ns, st->entries) : 0;
+
+			seq_printf(m, "%3u %5s %9lu %9lu %13llu %13llu %13llu\n",
+				   cpu, per_cpu(rk30_cpuidle_device, cpu).states[i].name,
+				   st->entries,
+				   st->demoted, st->residency_us, avg,
+				   st->exit_max_ns);
+		}
+	}
+
+	return 0;
+}
+
+static int rk30_cpuidle_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, rk30_cpuidle_stats_show, NULL);
+}
+
+static const struct file_operations rk30_cpuidle_stats_fops = {
+	.open		= rk30_cpuidle_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int __init rk30_cpuidle_init(void)
 {
 	struct cpuidle_device *dev;
@@ -83,7 +231,7 @@ static int __init rk30_cpuidle_init(void)
 		dev->cpu = cpu;
 		dev->state_count = ARRAY_SIZE(rk30_cpuidle_states);
 		memcpy(dev->states, rk30_cpuidle_states, sizeof(rk30_cpuidle_states));
-		dev->safe_state = &dev->states[0];
+		dev->safe_state = &dev->states[RK30_STATE_C1];
 
 		ret = cpuidle_register_device(dev);
 		if (ret) {
@@ -92,6 +240,9 @@ static int __init rk30_cpuidle_init(void)
 		}
 	}
 
+	debugfs_create_file("rk30_cpuidle", S_IRUSR, NULL, NULL,
+			    &rk30_cpuidle_stats_fops);
+
 	return 0;
 }
 late_initcall(rk30_cpuidle_init);
@@ -2165,7 +2165,7 @@ static void __init machine_rk30_board_init(void)
 static void __init rk30_reserve(void)
 {
 #ifdef CONFIG_ION
-	rk30_ion_pdata.heaps[0].base = board_mem_reserve_add("ion", ION_RESERVE_SIZE);
+	rk30_ion_pdata.heaps[0].base = board_cma_reserve_add("ion", ION_RESERVE_SIZE);
 #endif
 
 #ifdef CONFIG_FB_ROCKCHIP
@@ -714,11 +714,21 @@ static struct notifier_block rk3188_cpufreq_reboot_notifier = {
 	.notifier_call = rk3188_cpufreq_reboot_notifier_event,
 };
 
+static unsigned int rk3188_cpufreq_get_limit(struct cpufreq_policy *policy)
+{
+#ifdef CONFIG_RK30_CPU_FREQ_LIMIT_BY_TEMP
+	if (cpufreq_is_ondemand(policy))
+		return temp_limit_freq;
+#endif
+	return policy->max;
+}
+
 static struct cpufreq_driver rk3188_cpufreq_driver = {
 	.flags = CPUFREQ_CONST_LOOPS,
 	.verify = rk3188_cpufreq_verify,
 	.target = rk3188_cpufreq_target,
 	.get = rk3188_cpufreq_get,
+	.get_limit = rk3188_cpufreq_get_limit,
 	.init = rk3188_cpufreq_init,
 	.exit = rk3188_cpufreq_exit,
 	.name = "rk3188",
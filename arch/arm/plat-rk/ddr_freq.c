@@ -2,14 +2,17 @@
 #include <linux/clk.h>
 #include <linux/cpu.h>
 #include <linux/cpufreq.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/earlysuspend.h>
 #include <linux/freezer.h>
 #include <linux/fs.h>
 #include <linux/kthread.h>
+#include <linux/math64.h>
 #include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/reboot.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 
@@ -17,11 +20,13 @@
 #include <mach/clock.h>
 #include <mach/ddr.h>
 #include <mach/dvfs.h>
+#include <mach/io.h>
 
 #include <linux/rk_fb.h>
 //#include <linux/delay.h>
 
 #include <asm/cacheflush.h>
+#include <asm/hardware/cache-l2x0.h>
 #include <asm/tlbflush.h>
 #include <linux/vmalloc.h>
 
@@ -80,6 +85,77 @@ module_param_named(video_state, ddr.video_state, byte, S_IRUGO);
 module_param_named(auto_self_refresh, ddr.auto_self_refresh, bool, S_IRUGO);
 module_param_named(mode, ddr.mode, charp, S_IRUGO);
 
+/*
+ * Bandwidth monitor.
+ *
+ * The sys_status bits only cover masters that announce themselves, so a
+ * cpu streaming through memory runs at whatever rate the bits imply. The
+ * cpu side of the traffic is measured with the PL310 event counters: data
+ * read misses (DRREQ - DRHIT) are line fills from DDR and castouts (CO)
+ * are line write backs. With only two counters, consecutive windows
+ * alternate between reads and writes and the latest figure of each is
+ * used. The rate picked from that traffic is the lowest table rate that
+ * keeps utilization (of the theoretical peak) under bwmon_up_threshold;
+ * it is only lowered again once utilization drops under
+ * bwmon_down_threshold and bwmon_hold_ms has passed since the last raise.
+ * Only cpu traffic goes through the L2: gpu, vpu, display and other DMA
+ * masters are not measured at all, so the status bits remain floors.
+ */
+#if defined(CONFIG_CACHE_L2X0) && defined(RK30_L2C_BASE)
+#define DDRFREQ_BWMON
+#endif
+
+#define DDRFREQ_MAX_RATES	16
+#define L2X0_LINE_SIZE		32
+
+enum {
+	L2X0_EVENT_CO = 1,
+	L2X0_EVENT_DRHIT = 2,
+	L2X0_EVENT_DRREQ = 3,
+};
+
+#ifdef DDRFREQ_BWMON
+static bool bwmon = true;
+#else
+static bool bwmon;
+#endif
+module_param(bwmon, bool, S_IRUGO | S_IWUSR);
+static uint bwmon_period_ms = 50;
+module_param(bwmon_period_ms, uint, S_IRUGO | S_IWUSR);
+static uint bwmon_up_threshold = 40;
+module_param(bwmon_up_threshold, uint, S_IRUGO | S_IWUSR);
+static uint bwmon_down_threshold = 20;
+module_param(bwmon_down_threshold, uint, S_IRUGO | S_IWUSR);
+static uint bwmon_hold_ms = 500;
+module_param(bwmon_hold_ms, uint, S_IRUGO | S_IWUSR);
+/* bytes per DDR beat */
+static uint bwmon_bus_width = 4;
+module_param(bwmon_bus_width, uint, S_IRUGO | S_IWUSR);
+
+static struct {
+	bool armed;
+	bool reads;
+	ktime_t last;
+	u64 read_bps;
+	u64 write_bps;
+	unsigned int util;
+	unsigned long rate;
+	unsigned long hold_until;
+	unsigned long up;
+	unsigned long down;
+} ddr_bwmon;
+
+static struct {
+	unsigned long transitions;
+	ktime_t last;
+	unsigned int nr_rates;
+	struct {
+		unsigned long mhz;
+		unsigned long entries;
+		u64 time_ms;
+	} rates[DDRFREQ_MAX_RATES];
+} ddr_stats;
+
 static noinline void ddrfreq_set_sys_status(enum SYS_STATUS status)
 {
 	set_bit(status, &ddr.sys_status);
@@ -92,18 +168,146 @@ static noinline void ddrfreq_clear_sys_status(enum SYS_STATUS status)
 	wake_up(&ddr.wait);
 }
 
+static bool ddrfreq_bwmon_enabled(unsigned long sys_status)
+{
+#ifdef DDRFREQ_BWMON
+	return bwmon && !(sys_status & ((1 << SYS_STATUS_SUSPEND) | (1 << SYS_STATUS_REBOOT)));
+#else
+	return false;
+#endif
+}
+
+static u64 ddrfreq_peak_bps(unsigned long rate)
+{
+	/* double data rate */
+	return (u64)rate * 2 * bwmon_bus_width;
+}
+
+static void ddrfreq_bwmon_reset(void)
+{
+	ddr_bwmon.armed = false;
+	ddr_bwmon.read_bps = 0;
+	ddr_bwmon.write_bps = 0;
+	ddr_bwmon.util = 0;
+	ddr_bwmon.rate = 0;
+}
+
+static void ddrfreq_bwmon_sample(void)
+{
+#ifdef DDRFREQ_BWMON
+	void __iomem *base = RK30_L2C_BASE;
+	ktime_t now = ktime_get();
+	s64 us = ktime_us_delta(now, ddr_bwmon.last);
+	u32 cnt0 = readl_relaxed(base + L2X0_EVENT_CNT0_VAL);
+	u32 cnt1 = readl_relaxed(base + L2X0_EVENT_CNT1_VAL);
+
+	if (ddr_bwmon.armed && us > 0) {
+		if (ddr_bwmon.reads) {
+			u32 misses = cnt0 > cnt1 ? cnt0 - cnt1 : 0;
+			ddr_bwmon.read_bps = div64_u64((u64)misses * L2X0_LINE_SIZE * USEC_PER_SEC, us);
+		} else {
+			ddr_bwmon.write_bps = div64_u64((u64)cnt0 * L2X0_LINE_SIZE * USEC_PER_SEC, us);
+		}
+		ddr_bwmon.reads = !ddr_bwmon.reads;
+	}
+
+	/* counters are free-running, program them for the next window */
+	writel_relaxed(0, base + L2X0_EVENT_CNT_CTRL);
+	if (ddr_bwmon.reads) {
+		writel_relaxed(L2X0_EVENT_DRREQ << 2, base + L2X0_EVENT_CNT0_CFG);
+		writel_relaxed(L2X0_EVENT_DRHIT << 2, base + L2X0_EVENT_CNT1_CFG);
+	} else {
+		writel_relaxed(L2X0_EVENT_CO << 2, base + L2X0_EVENT_CNT0_CFG);
+		writel_relaxed(0, base + L2X0_EVENT_CNT1_CFG);
+	}
+	/* reset both counters and enable */
+	writel_relaxed(0x7, base + L2X0_EVENT_CNT_CTRL);
+
+	ddr_bwmon.last = now;
+	ddr_bwmon.armed = true;
+#endif
+}
+
+static unsigned long ddrfreq_bwmon_rate(void)
+{
+	struct cpufreq_frequency_table *table = dvfs_get_freq_volt_table(ddr.clk);
+	u64 bw = ddr_bwmon.read_bps + ddr_bwmon.write_bps;
+	unsigned long target = 0, max_rate = 0, ref;
+	int i;
+
+	for (i = 0; table && table[i].frequency != CPUFREQ_TABLE_END; i++) {
+		unsigned long rate = table[i].frequency * KHZ;
+
+		max_rate = max(max_rate, rate);
+		if (bw * 100 <= ddrfreq_peak_bps(rate) * bwmon_up_threshold &&
+		    (!target || rate < target))
+			target = rate;
+	}
+	if (!target)
+		target = max_rate;
+
+	ref = ddr_bwmon.rate ? ddr_bwmon.rate : clk_get_rate(ddr.clk);
+	ddr_bwmon.util = ref ? div64_u64(bw * 100, ddrfreq_peak_bps(ref)) : 0;
+
+	if (target > ddr_bwmon.rate) {
+		if (ddr_bwmon.rate)
+			ddr_bwmon.up++;
+		ddr_bwmon.rate = target;
+		ddr_bwmon.hold_until = jiffies + msecs_to_jiffies(bwmon_hold_ms);
+	} else if (target < ddr_bwmon.rate &&
+		   ddr_bwmon.util < bwmon_down_threshold &&
+		   time_after_eq(jiffies, ddr_bwmon.hold_until)) {
+		ddr_bwmon.down++;
+		ddr_bwmon.rate = target;
+	}
+
+	return ddr_bwmon.rate;
+}
+
+static void ddrfreq_stats_account(unsigned long old_rate, unsigned long new_rate)
+{
+	ktime_t now = ktime_get();
+	unsigned int i;
+
+	ddr_stats.transitions++;
+	for (i = 0; i < ddr_stats.nr_rates; i++) {
+		if (ddr_stats.rates[i].mhz == old_rate / MHZ && ddr_stats.last.tv64)
+			ddr_stats.rates[i].time_ms += ktime_to_ms(ktime_sub(now, ddr_stats.last));
+		if (ddr_stats.rates[i].mhz == new_rate / MHZ)
+			break;
+	}
+	if (i == ddr_stats.nr_rates && i < DDRFREQ_MAX_RATES) {
+		ddr_stats.rates[i].mhz = new_rate / MHZ;
+		ddr_stats.nr_rates++;
+	}
+	if (i < DDRFREQ_MAX_RATES)
+		ddr_stats.rates[i].entries++;
+	ddr_stats.last = now;
+}
+
 static void ddrfreq_mode(bool auto_self_refresh, unsigned long *target_rate, char *name)
 {
+	unsigned long rate = *target_rate;
+	unsigned long old_rate = clk_get_rate(ddr.clk);
+
 	ddr.mode = name;
 	if (auto_self_refresh != ddr.auto_self_refresh) {
 		ddr_set_auto_self_refresh(auto_self_refresh);
 		ddr.auto_self_refresh = auto_self_refresh;
 		dprintk(DEBUG_DDR, "change auto self refresh to %d when %s\n", auto_self_refresh, name);
 	}
-	if (*target_rate != clk_get_rate(ddr.clk)) {
-		if (clk_set_rate(ddr.clk, *target_rate) == 0) {
-			*target_rate = clk_get_rate(ddr.clk);
-			dprintk(DEBUG_DDR, "change freq to %lu MHz when %s\n", *target_rate / MHZ, name);
+	/* the rate of the mode is a floor for the bandwidth monitor */
+	if (ddr_bwmon.rate > rate)
+		rate = ddr_bwmon.rate;
+	if (rate != old_rate) {
+		if (clk_set_rate(ddr.clk, rate) == 0) {
+			rate = clk_get_rate(ddr.clk);
+			if (rate == old_rate)
+				return;
+			if (*target_rate >= ddr_bwmon.rate)
+				*target_rate = rate;
+			ddrfreq_stats_account(old_rate, rate);
+			dprintk(DEBUG_DDR, "change freq to %lu MHz when %s\n", rate / MHZ, name);
 		}
 	}
 }
@@ -157,8 +361,17 @@ static int ddrfreq_task(void *data)
 
 	do {
 		unsigned long status = ddr.sys_status;
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		if (ddrfreq_bwmon_enabled(status)) {
+			ddrfreq_bwmon_sample();
+			ddrfreq_bwmon_rate();
+			timeout = msecs_to_jiffies(bwmon_period_ms ? : 1);
+		} else if (ddr_bwmon.armed || ddr_bwmon.rate) {
+			ddrfreq_bwmon_reset();
+		}
 		ddrfreq_work(status);
-		wait_event_freezable(ddr.wait, (status != ddr.sys_status) || kthread_should_stop());
+		wait_event_freezable_timeout(ddr.wait, (status != ddr.sys_status) || kthread_should_stop(), timeout);
 	} while (!kthread_should_stop());
 
 	return 0;
@@ -505,6 +718,38 @@ static int ddrfreq_scanfreq_datatraing_3168(void)
 }
 #endif
 
+static int ddrfreq_stats_show(struct seq_file *m, void *v)
+{
+	unsigned int i;
+
+	seq_printf(m, "mode: %s\n", ddr.mode);
+	seq_printf(m, "rate: %lu MHz\n", clk_get_rate(ddr.clk) / MHZ);
+	seq_printf(m, "bwmon: %s rate %lu MHz\n", bwmon ? "on" : "off", ddr_bwmon.rate / MHZ);
+	seq_printf(m, "bandwidth: read %llu MB/s write %llu MB/s\n",
+		   div_u64(ddr_bwmon.read_bps, MHZ), div_u64(ddr_bwmon.write_bps, MHZ));
+	seq_printf(m, "utilization: %u%%\n", ddr_bwmon.util);
+	seq_printf(m, "transitions: %lu (bwmon up %lu down %lu)\n",
+		   ddr_stats.transitions, ddr_bwmon.up, ddr_bwmon.down);
+	seq_printf(m, "%8s %10s %12s\n", "MHz", "entries", "time_ms");
+	for (i = 0; i < ddr_stats.nr_rates; i++)
+		seq_printf(m, "%8lu %10lu %12llu\n", ddr_stats.rates[i].mhz,
+			   ddr_stats.rates[i].entries, ddr_stats.rates[i].time_ms);
+
+	return 0;
+}
+
+static int ddrfreq_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ddrfreq_stats_show, NULL);
+}
+
+static const struct file_operations ddrfreq_stats_fops = {
+	.open		= ddrfreq_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int ddrfreq_init(void)
 {
 	int i, ret;
@@ -662,6 +907,8 @@ static int ddrfreq_late_init(void)
 
 	register_reboot_notifier(&ddrfreq_reboot_notifier);
 
+	debugfs_create_file("ddrfreq", S_IRUSR, NULL, NULL, &ddrfreq_stats_fops);
+
 	pr_info("verion 3.2 20131126\n");
 	pr_info("fix cpu pause bug\n");
 	dprintk(DEBUG_DDR, "normal %luMHz video %luMHz video_low %luMHz dualview %luMHz idle %luMHz suspend %luMHz reboot %luMHz\n",
@@ -26,6 +26,7 @@
 #include <linux/delay.h>
 #include <linux/io.h>
 #include <linux/hrtimer.h>
+#include <linux/ktime.h>
 
 #define MHz	(1000 * 1000)
 static LIST_HEAD(rk_dvfs_tree);
@@ -44,11 +45,11 @@ static int dump_dbg_map(char *buf);
 
 
 /**************************************vd regulator functions***************************************/
-static void dvfs_volt_up_delay(struct vd_node *vd,int new_volt, int old_volt)
+static int dvfs_volt_up_time(struct vd_node *vd, int new_volt, int old_volt)
 {
 	int u_time;
 	if(new_volt<=old_volt)
-		return;
+		return 0;
 	if(vd->volt_time_flag>0)	
 		u_time=regulator_set_voltage_time(vd->regulator,old_volt,new_volt);
 	else
@@ -61,15 +62,27 @@ static void dvfs_volt_up_delay(struct vd_node *vd,int new_volt, int old_volt)
 	}
 	DVFS_DBG("%s:vd %s volt %d to %d delay %d us\n",__FUNCTION__,vd->name,
 		old_volt,new_volt,u_time);
+	return u_time;
+}
+
+static void dvfs_volt_delay_us(int u_time)
+{
 	if (u_time >= 1000) {
 		mdelay(u_time / 1000);
 		udelay(u_time % 1000);
-		DVFS_ERR("regulator set vol delay is larger 1ms,old is %d,new is %d\n",old_volt,new_volt);
+		DVFS_ERR("regulator set vol delay is larger 1ms, %d us\n", u_time);
 	} else if (u_time) {
 		udelay(u_time);
-	}			
+	}
 }
-int dvfs_regulator_set_voltage_readback(struct regulator *regulator, int min_uV, int max_uV)
+
+static void dvfs_volt_up_delay(struct vd_node *vd,int new_volt, int old_volt)
+{
+	dvfs_volt_delay_us(dvfs_volt_up_time(vd, new_volt, old_volt));
+}
+
+static int dvfs_regulator_set_voltage_settle(struct regulator *regulator, int min_uV, int max_uV,
+		int settle_us)
 {
 	int ret = 0, read_back = 0;
 	ret = dvfs_regulator_set_voltage(regulator, max_uV, max_uV);
@@ -77,7 +90,7 @@ int dvfs_regulator_set_voltage_readback(struct regulator *regulator, int min_uV,
 		DVFS_ERR("%s now read back to check voltage\n", __func__);
 
 		/* read back to judge if it is already effect */
-		mdelay(2);
+		dvfs_volt_delay_us(settle_us);
 		read_back = dvfs_regulator_get_voltage(regulator);
 		if (read_back == max_uV) {
 			DVFS_ERR("%s set ERROR but already effected, volt=%d\n", __func__, read_back);
@@ -88,17 +101,102 @@ int dvfs_regulator_set_voltage_readback(struct regulator *regulator, int min_uV,
 	}
 	return ret;
 }
+
+int dvfs_regulator_set_voltage_readback(struct regulator *regulator, int min_uV, int max_uV)
+{
+	return dvfs_regulator_set_voltage_settle(regulator, min_uV, max_uV, 2000);
+}
+
+/*
+ * Program one domain. A failed write is only read back once the ramp has
+ * had time to settle; when the domain's ramp time is characterized that
+ * is the ramp time instead of the blind 2ms.
+ */
+static int dvfs_vd_set_voltage(struct vd_node *vd, int volt)
+{
+	int settle_us = 2000;
+
+	if (vd->volt_time_flag > 0)
+		settle_us = max(dvfs_volt_up_time(vd, volt, vd->cur_volt), 1);
+	vd->volt_writes++;
+	return dvfs_regulator_set_voltage_settle(vd->regulator, volt, volt, settle_us);
+}
+
 // for clk enable case to get vd regulator info
 void clk_enable_dvfs_regulator_check(struct vd_node *vd)
 {
+	/* the last programmed voltage is still valid, no need to ask the PMIC */
+	if (vd->cur_volt > 0 && vd->volt_set_flag == DVFS_SET_VOLT_SUCCESS)
+		return;
+
 	vd->cur_volt = dvfs_regulator_get_voltage(vd->regulator);
 	if(vd->cur_volt<=0)
 	{
 		vd->volt_set_flag = DVFS_SET_VOLT_FAILURE;
+		return;
 	}
 	vd->volt_set_flag = DVFS_SET_VOLT_SUCCESS;
 }
 
+/*
+ * Voltage transactions.
+ *
+ * A step of dvfs_scale_volt() may move both the arm and the logic domain.
+ * Programming one regulator, waiting for its ramp and then doing the same
+ * for the other serializes two ramps on the clk_set_rate() path. When both
+ * domains have a characterized ramp time (the PMIC reports
+ * set_voltage_time) the writes of a step are queued and committed back to
+ * back, followed by one delay covering the slower ramp. The steps are
+ * computed so that any mix of old and new voltages of a step respects the
+ * arm/logic margins, so overlapping the ramps is safe. Writes matching the
+ * last programmed voltage are dropped.
+ */
+struct dvfs_volt_trans {
+	int nr;
+	struct {
+		struct vd_node *vd;
+		int volt;
+	} op[2];
+};
+
+static bool dvfs_trans_can_coalesce(struct vd_node *vd, struct vd_node *vd_dep)
+{
+	return vd->volt_time_flag > 0 && vd_dep->volt_time_flag > 0;
+}
+
+static void dvfs_trans_add(struct dvfs_volt_trans *trans, struct vd_node *vd, int volt)
+{
+	if (vd->cur_volt == volt) {
+		vd->volt_writes_skipped++;
+		return;
+	}
+	trans->op[trans->nr].vd = vd;
+	trans->op[trans->nr].volt = volt;
+	trans->nr++;
+}
+
+/* Returns the domain whose write failed, or NULL */
+static struct vd_node *dvfs_trans_commit(struct dvfs_volt_trans *trans)
+{
+	int i, u_time, settle = 0;
+
+	for (i = 0; i < trans->nr; i++) {
+		struct vd_node *vd = trans->op[i].vd;
+		int volt = trans->op[i].volt;
+
+		DVFS_DBG("\t\t%s:%d->%d\n", vd->name, vd->cur_volt, volt);
+		if (dvfs_vd_set_voltage(vd, volt) < 0)
+			return vd;
+		u_time = dvfs_volt_up_time(vd, volt, vd->cur_volt);
+		settle = max(settle, u_time);
+		vd->cur_volt = volt;
+	}
+	dvfs_volt_delay_us(settle);
+	trans->nr = 0;
+
+	return NULL;
+}
+
 static void dvfs_get_vd_regulator_volt_list(struct vd_node *vd)
 {
 	unsigned i,selector=dvfs_regulator_count_voltages(vd->regulator);
@@ -309,6 +407,13 @@ int dvfs_clk_disable_limit(struct clk *clk)
 	return 0;
 }
 
+static void dvfs_account_latency(struct vd_node *vd, s64 us)
+{
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	vd->trans_lat[min(bucket, DVFS_LAT_BUCKETS - 1)]++;
+}
+
 int dvfs_vd_clk_set_rate(struct clk *clk, unsigned long rate)
 {
 	int ret = -1;
@@ -324,9 +429,16 @@ int dvfs_vd_clk_set_rate(struct clk *clk, unsigned long rate)
 	#endif
 	
 	if(dvfs_info->vd&&dvfs_info->vd->vd_dvfs_target){
+		unsigned long rate_old;
+		ktime_t start;
+
 		// mutex_lock(&vd->dvfs_mutex);
 		mutex_lock(&rk_dvfs_mutex);
+		rate_old = clk_get_rate(clk);
+		start = ktime_get();
 		ret = dvfs_info->vd->vd_dvfs_target(clk, rate);
+		if (clk_get_rate(clk) != rate_old)
+			dvfs_account_latency(dvfs_info->vd, ktime_us_delta(ktime_get(), start));
 		mutex_unlock(&rk_dvfs_mutex);
 		// mutex_unlock(&vd->dvfs_mutex);
 	}
@@ -885,6 +997,7 @@ int dvfs_scale_volt(struct vd_node *vd_clk, struct vd_node *vd_dep,
 	int volt_tmp = 0, volt_dep_tmp = 0;
 	int volt_pre = 0, volt_dep_pre = 0;
 	int ret = 0;
+	bool coalesce;
 
 	DVFS_DBG("ENTER %s, volt=%d(old=%d), volt_dep=%d(dep_old=%d)\n", __func__, volt_new, volt_old, volt_dep_new, volt_dep_old);
 	regulator = vd_clk->regulator;
@@ -894,6 +1007,7 @@ int dvfs_scale_volt(struct vd_node *vd_clk, struct vd_node *vd_dep,
 		DVFS_ERR("%s dvfs_clk->vd->regulator or depend->dep_vd->regulator == NULL\n", __func__);
 		return -1;
 	}
+	coalesce = dvfs_trans_can_coalesce(vd_clk, vd_dep);
 
 	volt = volt_old;
 	volt_dep = volt_dep_old;
@@ -940,9 +1054,25 @@ int dvfs_scale_volt(struct vd_node *vd_clk, struct vd_node *vd_dep,
 			goto fail;
 		}
 
+		if (coalesce) {
+			struct dvfs_volt_trans trans = { .nr = 0 };
+			struct vd_node *failed;
+
+			dvfs_trans_add(&trans, vd_clk, volt);
+			dvfs_trans_add(&trans, vd_dep, volt_dep);
+			failed = dvfs_trans_commit(&trans);
+			if (failed) {
+				DVFS_ERR("%s %s set voltage err, Vnew = %d(was %d)mV, dep Vnew = %d(was %d)mV\n",
+						__func__, failed->name, volt_new, volt_old, volt_dep_new, volt_dep_old);
+				goto fail;
+			}
+			DVFS_DBG("\t\tNOW:Volt=%d, volt_dep=%d\n", volt, volt_dep);
+			continue;
+		}
+
 		if (vd_clk->cur_volt != volt) {
 			DVFS_DBG("\t\t%s:%d->%d\n", vd_clk->name, vd_clk->cur_volt, volt);
-			ret = dvfs_regulator_set_voltage_readback(regulator, volt, volt);
+			ret = dvfs_vd_set_voltage(vd_clk, volt);
 			//udelay(get_volt_up_delay(volt, volt_pre));
 			dvfs_volt_up_delay(vd_clk,volt, volt_pre);
 			if (ret < 0) {
@@ -954,7 +1084,7 @@ int dvfs_scale_volt(struct vd_node *vd_clk, struct vd_node *vd_dep,
 		}
 		if (vd_dep->cur_volt != volt_dep) {
 			DVFS_DBG("\t\t%s:%d->%d\n", vd_dep->name, vd_dep->cur_volt, volt_dep);
-			ret = dvfs_regulator_set_voltage_readback(regulator_dep, volt_dep, volt_dep);
+			ret = dvfs_vd_set_voltage(vd_dep, volt_dep);
 			//udelay(get_volt_up_delay(volt_dep, volt_dep_pre));
 			dvfs_volt_up_delay(vd_dep,volt_dep, volt_dep_pre);
 			if (ret < 0) {
@@ -1005,8 +1135,12 @@ int dvfs_scale_volt_direct(struct vd_node *vd_clk, int volt_new)
 	}
 
 	DVFS_DBG("ENTER %s, volt=%d(old=%d)\n", __func__, volt_new, vd_clk->cur_volt);
+	if (vd_clk->cur_volt == volt_new && vd_clk->volt_set_flag == DVFS_SET_VOLT_SUCCESS) {
+		vd_clk->volt_writes_skipped++;
+		return 0;
+	}
 	if (!IS_ERR_OR_NULL(vd_clk->regulator)) {
-		ret = dvfs_regulator_set_voltage_readback(vd_clk->regulator, volt_new, volt_new);
+		ret = dvfs_vd_set_voltage(vd_clk, volt_new);
 		//udelay(get_volt_up_delay(volt_new, vd_clk->cur_volt));
 		dvfs_volt_up_delay(vd_clk,volt_new, vd_clk->cur_volt);
 		if (ret < 0) {
@@ -1032,7 +1166,6 @@ int dvfs_scale_volt_bystep(struct vd_node *vd_clk, struct vd_node *vd_dep, int v
 		int cur_clk_biger_than_dep, int cur_dep_biger_than_clk, int new_clk_biger_than_dep, int new_dep_biger_than_clk)
 {
 
-	struct regulator *regulator, *regulator_dep;
 	int volt_new_corrected = 0, volt_dep_new_corrected = 0;
 	int volt_old = 0, volt_dep_old = 0;
 	int ret = 0;
@@ -1058,16 +1191,13 @@ int dvfs_scale_volt_bystep(struct vd_node *vd_clk, struct vd_node *vd_dep, int v
 	}
 
 	if (cur_clk_biger_than_dep != new_clk_biger_than_dep || cur_dep_biger_than_clk != new_dep_biger_than_clk) {
-		regulator = vd_clk->regulator;
-		regulator_dep = vd_dep->regulator;
-
 		volt_new_corrected = volt_new;
 		volt_dep_new_corrected = volt_dep_new;
 		correct_volt(&volt_new_corrected, &volt_dep_new_corrected, new_clk_biger_than_dep, new_dep_biger_than_clk);
 
 		if (vd_clk->cur_volt != volt_new_corrected) {
 			DVFS_DBG("%s:%d->%d\n", vd_clk->name, vd_clk->cur_volt, volt_new_corrected);
-			ret = dvfs_regulator_set_voltage_readback(regulator, volt_new_corrected, volt_new_corrected);
+			ret = dvfs_vd_set_voltage(vd_clk, volt_new_corrected);
 			//udelay(get_volt_up_delay(volt_new_corrected, vd_clk->cur_volt));
 			dvfs_volt_up_delay(vd_clk,volt_new_corrected, vd_clk->cur_volt);
 			if (ret < 0) {
@@ -1079,7 +1209,7 @@ int dvfs_scale_volt_bystep(struct vd_node *vd_clk, struct vd_node *vd_dep, int v
 		}
 		if (vd_dep->cur_volt != volt_dep_new_corrected) {
 			DVFS_DBG("%s:%d->%d\n", vd_clk->name, vd_clk->cur_volt, volt_dep_new_corrected);
-			ret = dvfs_regulator_set_voltage_readback(regulator_dep, volt_dep_new_corrected, volt_dep_new_corrected);
+			ret = dvfs_vd_set_voltage(vd_dep, volt_dep_new_corrected);
 			//udelay(get_volt_up_delay(volt_dep_new_corrected, vd_dep->cur_volt));
 			dvfs_volt_up_delay(vd_dep,volt_dep_new_corrected, vd_dep->cur_volt);
 			if (ret < 0) {
@@ -1466,6 +1596,31 @@ static ssize_t dvfs_tree_show(struct kobject *kobj, struct kobj_attribute *attr,
 
 }
 
+static ssize_t dvfs_latency_show(struct kobject *kobj, struct kobj_attribute *attr,
+		char *buf)
+{
+	struct vd_node *vd;
+	char *s = buf;
+	int i;
+
+	mutex_lock(&rk_dvfs_mutex);
+	list_for_each_entry(vd, &rk_dvfs_tree, node) {
+		s += sprintf(s, "%s: volt %d writes %lu skipped %lu\n", vd->name,
+				vd->cur_volt, vd->volt_writes, vd->volt_writes_skipped);
+		for (i = 0; i < DVFS_LAT_BUCKETS; i++) {
+			if (!vd->trans_lat[i])
+				continue;
+			if (i == DVFS_LAT_BUCKETS - 1)
+				s += sprintf(s, "  >= %6lu us: %lu\n", 1UL << (i - 1), vd->trans_lat[i]);
+			else
+				s += sprintf(s, "  <  %6lu us: %lu\n", 1UL << i, vd->trans_lat[i]);
+		}
+	}
+	mutex_unlock(&rk_dvfs_mutex);
+
+	return s - buf;
+}
+
 static void avs_timer_fn(unsigned long data)
 {
 	int i;
@@ -1512,6 +1667,7 @@ static struct dvfs_attribute dvfs_attrs[] = {
 //	__ATTR(avs_dyn,		S_IRUSR | S_IRGRP | S_IWUSR,	avs_dyn_show,	avs_dyn_store),
 	__ATTR(avs_now,		S_IRUSR | S_IRGRP | S_IWUSR,	avs_now_show,	avs_now_store),
 #endif
+	__ATTR(dvfs_latency,	S_IRUSR | S_IRGRP,		dvfs_latency_show,	NULL),
 };
 
 static int __init dvfs_init(void)
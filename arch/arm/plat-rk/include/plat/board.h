@@ -510,6 +510,22 @@ void rk28_send_wakeup_key(void);
 phys_addr_t __init board_mem_reserve_add(char *name, size_t size);
 void __init board_mem_reserved(void);
 
+/* for reserved memory lent to movable pages until a driver claims it
+ * function: board_cma_reserve_add
+ * return value: start address of reserved memory */
+#ifdef CONFIG_CMA
+phys_addr_t __init board_cma_reserve_add(char *name, size_t size);
+int board_cma_claim(phys_addr_t base, size_t size);
+void board_cma_release(phys_addr_t base, size_t size);
+#else
+static inline phys_addr_t board_cma_reserve_add(char *name, size_t size)
+{
+	return board_mem_reserve_add(name, size);
+}
+static inline int board_cma_claim(phys_addr_t base, size_t size) { return 0; }
+static inline void board_cma_release(phys_addr_t base, size_t size) {}
+#endif
+
 extern struct rk29_sdmmc_platform_data default_sdmmc0_data;
 extern struct rk29_sdmmc_platform_data default_sdmmc1_data;
 
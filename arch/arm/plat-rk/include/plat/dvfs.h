@@ -34,8 +34,13 @@ typedef int (*dvfs_clk_disable_callback)(struct clk *clk,int on);
  * @req_volt_list:	The list of clocks requests
  * @dvfs_mutex:		Lock
  * @vd_dvfs_target:	Callback function	
+ * @volt_writes:	Regulator writes issued for this domain
+ * @volt_writes_skipped:	Writes dropped because the voltage was already programmed
+ * @trans_lat:		Histogram of rate transition latency, bucket n counts
+ *			transitions that took less than 2^n us
  */
  #define VD_VOL_LIST_CNT (200)
+ #define DVFS_LAT_BUCKETS (16)
  #define VD_LIST_RELATION_L 0
  #define VD_LIST_RELATION_H 1
 
@@ -55,6 +60,9 @@ struct vd_node {
 	dvfs_set_rate_callback      vd_dvfs_target;
 	unsigned n_voltages;
 	int volt_list[VD_VOL_LIST_CNT];
+	unsigned long volt_writes;
+	unsigned long volt_writes_skipped;
+	unsigned long trans_lat[DVFS_LAT_BUCKETS];
 };
 
 /**
@@ -1,6 +1,15 @@
 #include <plat/board.h>
 #include <linux/memblock.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/setup.h>
+#include <asm/cacheflush.h>
 
 static size_t reserved_size = 0;
 static phys_addr_t reserved_base_end = 0;
@@ -19,12 +28,256 @@ phys_addr_t __init board_mem_reserve_add(char *name, size_t size)
     return base;
 }
 
+#ifdef CONFIG_CMA
+/*
+ * Lent reservations.
+ *
+ * A range added with board_cma_reserve_add() is carved out like any other
+ * reservation, but instead of being removed from the kernel it is handed
+ * to the page allocator as MIGRATE_CMA pageblocks, which only serve movable
+ * (page cache and anonymous) allocations. The owning driver takes pieces
+ * back with board_cma_claim(), which migrates whatever lives there away,
+ * and hands them out again with board_cma_release().
+ *
+ * Only use this for buffers that are allocated on demand. Memory that is
+ * owned by hardware from boot (the framebuffer being scanned out, buffers
+ * ioremapped once at probe) must stay a plain reservation.
+ */
+#define BOARD_CMA_AREAS		4
+
+struct board_cma_area {
+	const char	*name;
+	phys_addr_t	base;
+	size_t		size;
+	bool		lent;		/* pageblocks handed to the buddy allocator */
+	size_t		claimed;	/* bytes currently taken back */
+	unsigned long	claims;
+	unsigned long	failures;	/* claims that could not migrate the range */
+	int		last_error;
+	u64		claim_us;
+	u64		claim_max_us;
+};
+
+static struct board_cma_area board_cma_areas[BOARD_CMA_AREAS];
+static int board_cma_count;
+static DEFINE_MUTEX(board_cma_mutex);
+
+/*
+ * Lent ranges must start and end on a MAX_ORDER block boundary, so that
+ * the buddy allocator never merges a lent page with one outside the range.
+ */
+static unsigned long board_cma_align(void)
+{
+	return max_t(unsigned long, MAX_ORDER_NR_PAGES, pageblock_nr_pages) << PAGE_SHIFT;
+}
+
+phys_addr_t __init board_cma_reserve_add(char *name, size_t size)
+{
+	struct board_cma_area *area;
+	unsigned long align = board_cma_align();
+	phys_addr_t base;
+
+	if (board_cma_count == BOARD_CMA_AREAS)
+		return board_mem_reserve_add(name, size);
+
+	if (reserved_base_end == 0)
+		reserved_base_end = meminfo.bank[0].start + meminfo.bank[0].size;
+
+	size = ALIGN(size, align);
+	base = (reserved_base_end - reserved_size - size) & ~(align - 1);
+	reserved_size = reserved_base_end - base;
+
+	area = &board_cma_areas[board_cma_count++];
+	area->name = name;
+	area->base = base;
+	area->size = size;
+
+	pr_info("memory reserve: Memory(base:0x%x size:%dM) lent for <%s>\n",
+		base, size/SZ_1M, name);
+	return base;
+}
+
+static struct board_cma_area *board_cma_find(phys_addr_t base, size_t size)
+{
+	int i;
+
+	for (i = 0; i < board_cma_count; i++) {
+		struct board_cma_area *area = &board_cma_areas[i];
+
+		if (base >= area->base && base + size <= area->base + area->size)
+			return area;
+	}
+	return NULL;
+}
+
+/*
+ * Runs once the page allocator is up. A range that straddles two zones
+ * cannot be migrated as a whole, so it simply stays reserved.
+ */
+static int __init board_cma_activate(void)
+{
+	int i;
+
+	for (i = 0; i < board_cma_count; i++) {
+		struct board_cma_area *area = &board_cma_areas[i];
+		unsigned long pfn = __phys_to_pfn(area->base);
+		unsigned long end = pfn + (area->size >> PAGE_SHIFT);
+		struct zone *zone;
+
+		if (!pfn_valid(pfn) || !pfn_valid(end - 1) ||
+		    page_zone(pfn_to_page(pfn)) != page_zone(pfn_to_page(end - 1))) {
+			pr_warning("memory reserve: <%s> spans zones, keeping it reserved\n",
+				   area->name);
+			continue;
+		}
+		zone = page_zone(pfn_to_page(pfn));
+
+		for (; pfn < end; pfn += pageblock_nr_pages)
+			init_cma_reserved_pageblock(pfn_to_page(pfn));
+		area->lent = true;
+
+		pr_info("memory reserve: <%s> %dM lent to zone %s\n",
+			area->name, area->size/SZ_1M, zone->name);
+	}
+	return 0;
+}
+core_initcall(board_cma_activate);
+
+/* Claimed pages held page cache or user data, clear them for the device */
+static void board_cma_clear(phys_addr_t base, size_t size)
+{
+	unsigned long pfn = __phys_to_pfn(base);
+	unsigned long end = __phys_to_pfn(base + size);
+
+	for (; pfn < end; pfn++) {
+		void *ptr = kmap_atomic(pfn_to_page(pfn), KM_USER0);
+
+		memset(ptr, 0, PAGE_SIZE);
+		dmac_flush_range(ptr, ptr + PAGE_SIZE);
+		kunmap_atomic(ptr, KM_USER0);
+	}
+	outer_flush_range(base, base + size);
+}
+
+/*
+ * Take [base, base + size) back from the page allocator for a device.
+ * Ranges outside any lent area are static reservations and always succeed.
+ * May sleep; returns -EBUSY if some page could not be migrated away.
+ */
+int board_cma_claim(phys_addr_t base, size_t size)
+{
+	struct board_cma_area *area;
+	ktime_t start;
+	u64 us;
+	int ret;
+
+	size = PAGE_ALIGN(size);
+	area = board_cma_find(base, size);
+	if (!area || !area->lent)
+		return 0;
+
+	start = ktime_get();
+
+	mutex_lock(&board_cma_mutex);
+	ret = alloc_contig_range(__phys_to_pfn(base), __phys_to_pfn(base + size));
+	if (!ret)
+		board_cma_clear(base, size);
+
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	area->claims++;
+	area->claim_us += us;
+	if (us > area->claim_max_us)
+		area->claim_max_us = us;
+	if (ret) {
+		area->failures++;
+		area->last_error = ret;
+	} else {
+		area->claimed += size;
+	}
+	mutex_unlock(&board_cma_mutex);
+
+	if (ret)
+		pr_warning("memory reserve: claiming %dK at 0x%x for <%s> failed: %d\n",
+			   size/SZ_1K, base, area->name, ret);
+	return ret;
+}
+EXPORT_SYMBOL(board_cma_claim);
+
+void board_cma_release(phys_addr_t base, size_t size)
+{
+	struct board_cma_area *area;
+
+	size = PAGE_ALIGN(size);
+	area = board_cma_find(base, size);
+	if (!area || !area->lent)
+		return;
+
+	free_contig_range(__phys_to_pfn(base), size >> PAGE_SHIFT);
+
+	mutex_lock(&board_cma_mutex);
+	area->claimed -= size;
+	mutex_unlock(&board_cma_mutex);
+}
+EXPORT_SYMBOL(board_cma_release);
+
+static int board_cma_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	seq_printf(m, "name             base       size_kb lent claimed_kb    claims  failures errno    avg_us    max_us\n");
+	mutex_lock(&board_cma_mutex);
+	for (i = 0; i < board_cma_count; i++) {
+		struct board_cma_area *area = &board_cma_areas[i];
+		u64 avg = area->claims ? div64_u64(area->claim_us, area->claims) : 0;
+
+		seq_printf(m, "%-16s 0x%08x %7u %4d %10u %9lu %9lu %5d %9llu %9llu\n",
+			   area->name, area->base, area->size/SZ_1K, area->lent,
+			   area->claimed/SZ_1K, area->claims, area->failures,
+			   area->last_error, avg, area->claim_max_us);
+	}
+	mutex_unlock(&board_cma_mutex);
+
+	return 0;
+}
+
+static int board_cma_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, board_cma_stats_show, NULL);
+}
+
+static const struct file_operations board_cma_stats_fops = {
+	.open		= board_cma_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init board_cma_debugfs_init(void)
+{
+	if (board_cma_count)
+		debugfs_create_file("mem_reserve", S_IRUSR, NULL, NULL,
+				    &board_cma_stats_fops);
+	return 0;
+}
+late_initcall(board_cma_debugfs_init);
+#endif /* CONFIG_CMA */
+
 void __init board_mem_reserved(void)
 {
     phys_addr_t base = reserved_base_end - reserved_size;
+#ifdef CONFIG_CMA
+    int i;
+#endif
 
     if(reserved_size){
         memblock_remove(base, reserved_size);
 	    pr_info("memory reserve: Total reserved %dM\n", reserved_size/SZ_1M);
     }
+#ifdef CONFIG_CMA
+    /* lent ranges stay mapped, but out of the buddy allocator until activation */
+    for (i = 0; i < board_cma_count; i++) {
+        memblock_add(board_cma_areas[i].base, board_cma_areas[i].size);
+        memblock_reserve(board_cma_areas[i].base, board_cma_areas[i].size);
+    }
+#endif
 }
@@ -1799,6 +1799,37 @@ static void blk_account_io_done(struct request *req)
 	}
 }
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static void blk_latency_hist_add(unsigned long *hist, u64 start, u64 end)
+{
+	u64 usecs = end > start ? div_u64(end - start, NSEC_PER_USEC) : 0;
+
+	hist[min_t(int, fls64(usecs), BLK_LAT_HIST_BUCKETS - 1)]++;
+}
+
+/*
+ * Both hooks run under queue_lock, which is what keeps the plain
+ * counters consistent.  Only requests that went through
+ * blk_dequeue_request() with blk_account_rq() true carry timestamps.
+ */
+static void blk_latency_hist_dispatch(struct request *rq)
+{
+	blk_latency_hist_add(rq->q->latency_hist.wait[rq_data_dir(rq)],
+			     rq_start_time_ns(rq), rq_io_start_time_ns(rq));
+}
+
+static void blk_latency_hist_done(struct request *req)
+{
+	if (blk_account_rq(req))
+		blk_latency_hist_add(
+			req->q->latency_hist.service[rq_data_dir(req)],
+			rq_io_start_time_ns(req), sched_clock());
+}
+#else
+static inline void blk_latency_hist_dispatch(struct request *rq) {}
+static inline void blk_latency_hist_done(struct request *req) {}
+#endif
+
 /**
  * blk_peek_request - peek at the top of a request queue
  * @q: request queue to peek at
@@ -1916,6 +1947,7 @@ void blk_dequeue_request(struct request *rq)
 	if (blk_account_rq(rq)) {
 		q->in_flight[rq_is_sync(rq)]++;
 		set_io_start_time_ns(rq);
+		blk_latency_hist_dispatch(rq);
 	}
 }
 
@@ -2206,6 +2238,7 @@ static void blk_finish_request(struct request *req, int error)
 
 
 	blk_account_io_done(req);
+	blk_latency_hist_done(req);
 
 	if (req->end_io)
 		req->end_io(req, error);
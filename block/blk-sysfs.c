@@ -266,6 +266,50 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static ssize_t queue_latency_hist_show(struct request_queue *q, char *page)
+{
+	struct blk_latency_hist *hist;
+	ssize_t ret;
+	int i;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	spin_lock_irq(q->queue_lock);
+	*hist = q->latency_hist;
+	spin_unlock_irq(q->queue_lock);
+
+	ret = sprintf(page, "%10s %10s %10s %10s %10s\n", "usecs",
+		      "read_wait", "write_wait", "read_svc", "write_svc");
+	for (i = 0; i < BLK_LAT_HIST_BUCKETS; i++) {
+		char range[12];
+
+		if (i < BLK_LAT_HIST_BUCKETS - 1)
+			snprintf(range, sizeof(range), "<%lu", 1UL << i);
+		else
+			snprintf(range, sizeof(range), ">=%lu", 1UL << (i - 1));
+		ret += sprintf(page + ret, "%10s %10lu %10lu %10lu %10lu\n",
+			       range, hist->wait[READ][i], hist->wait[WRITE][i],
+			       hist->service[READ][i], hist->service[WRITE][i]);
+	}
+
+	kfree(hist);
+	return ret;
+}
+
+static ssize_t
+queue_latency_hist_store(struct request_queue *q, const char *page,
+			 size_t count)
+{
+	spin_lock_irq(q->queue_lock);
+	memset(&q->latency_hist, 0, sizeof(q->latency_hist));
+	spin_unlock_irq(q->queue_lock);
+	return count;
+}
+#endif
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -380,6 +424,14 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+static struct queue_sysfs_entry queue_latency_hist_entry = {
+	.attr = {.name = "latency_hist", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_latency_hist_show,
+	.store = queue_latency_hist_store,
+};
+#endif
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -402,6 +454,9 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+	&queue_latency_hist_entry.attr,
+#endif
 	NULL,
 };
 
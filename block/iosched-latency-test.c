@@ -0,0 +1,302 @@
+/*
+ * Read latency under write load, for comparing I/O schedulers.
+ *
+ * The module issues small synchronous reads to a block device, first on
+ * an idle device and then while writer threads keep the queue full of
+ * large asynchronous writes, as background writeback does.  It prints
+ * the mean, median, 90th and 99th percentile and worst read latency of
+ * each phase, and the write throughput of the second.  Load it once per
+ * scheduler (echo row > /sys/block/<dev>/queue/scheduler) to compare
+ * them on the same device.
+ *
+ * Reads go to the first half of the device and writes to the second.
+ * THE CONTENTS OF THE DEVICE ARE OVERWRITTEN.  It is opened exclusively,
+ * so a mounted partition is refused.
+ *
+ *	modprobe iosched-latency-test dev=/dev/block/mmcblk0p9
+ *
+ * The module does its work at load time and always fails to load.
+ */
+#define pr_fmt(fmt) "iosched-latency-test: " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/delay.h>
+#include <linux/elevator.h>
+#include <linux/fs.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#define ILT_MAX_WRITERS		8
+#define ILT_MAX_WRITE_PAGES	64
+#define ILT_MODE		(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+static char *dev;
+static unsigned int reads = 500;
+static unsigned int read_interval = 5;
+static unsigned int writers = 2;
+static unsigned int write_kb = 128;
+static unsigned int write_depth = 32;
+
+static struct block_device *ilt_bdev;
+static sector_t ilt_nr_sects;
+static struct page *ilt_read_page;
+static struct page *ilt_write_pages[ILT_MAX_WRITE_PAGES];
+static struct task_struct *ilt_writers[ILT_MAX_WRITERS];
+
+static atomic_t ilt_inflight = ATOMIC_INIT(0);
+static atomic_t ilt_write_errors = ATOMIC_INIT(0);
+static atomic_long_t ilt_written = ATOMIC_LONG_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(ilt_wait);
+
+struct ilt_read {
+	struct completion done;
+	int err;
+};
+
+static void ilt_write_end_io(struct bio *bio, int err)
+{
+	if (err)
+		atomic_inc(&ilt_write_errors);
+	else
+		atomic_long_add((unsigned long)bio->bi_private, &ilt_written);
+	bio_put(bio);
+
+	if (atomic_dec_return(&ilt_inflight) < write_depth)
+		wake_up(&ilt_wait);
+}
+
+/*
+ * Keep up to write_depth asynchronous writes of write_kb in flight,
+ * walking sequentially through this writer's slice of the second half
+ * of the device.
+ */
+static int ilt_writer(void *data)
+{
+	unsigned long idx = (unsigned long)data;
+	unsigned int nr_pages = write_kb / (PAGE_SIZE / 1024);
+	sector_t region = ilt_nr_sects / 2;
+	sector_t base, sector;
+	struct bio *bio;
+	unsigned int i, bytes;
+
+	sector_div(region, writers);
+	base = ilt_nr_sects / 2 + region * idx;
+	sector = base;
+
+	while (!kthread_should_stop()) {
+		wait_event(ilt_wait, atomic_read(&ilt_inflight) < write_depth ||
+			   kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+
+		bio = bio_alloc(GFP_KERNEL, nr_pages);
+		bio->bi_bdev = ilt_bdev;
+		bio->bi_sector = sector;
+		bio->bi_end_io = ilt_write_end_io;
+		for (i = 0; i < nr_pages; i++)
+			if (!bio_add_page(bio, ilt_write_pages[i], PAGE_SIZE, 0))
+				break;
+		bytes = bio->bi_size;
+		bio->bi_private = (void *)(unsigned long)bytes;
+
+		atomic_inc(&ilt_inflight);
+		submit_bio(WRITE, bio);
+
+		sector += bytes >> 9;
+		if (sector + (bytes >> 9) > base + region)
+			sector = base;
+	}
+
+	return 0;
+}
+
+static void ilt_read_end_io(struct bio *bio, int err)
+{
+	struct ilt_read *r = bio->bi_private;
+
+	r->err = err;
+	complete(&r->done);
+}
+
+static int ilt_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Time "reads" one-page reads at random places in the first half. */
+static int ilt_read_phase(const char *name, u32 *lat)
+{
+	u32 blocks = min_t(sector_t, ilt_nr_sects / 2 / (PAGE_SIZE >> 9),
+			   UINT_MAX);
+	struct ilt_read r;
+	struct bio *bio;
+	u64 sum = 0;
+	ktime_t start;
+	int i;
+
+	for (i = 0; i < reads; i++) {
+		bio = bio_alloc(GFP_KERNEL, 1);
+		bio->bi_bdev = ilt_bdev;
+		bio->bi_sector = (sector_t)(random32() % blocks) *
+				 (PAGE_SIZE >> 9);
+		bio->bi_end_io = ilt_read_end_io;
+		bio->bi_private = &r;
+		bio_add_page(bio, ilt_read_page, PAGE_SIZE, 0);
+		init_completion(&r.done);
+
+		start = ktime_get();
+		submit_bio(READ_SYNC, bio);
+		wait_for_completion(&r.done);
+		lat[i] = ktime_us_delta(ktime_get(), start);
+		bio_put(bio);
+
+		if (r.err) {
+			pr_err("%s: read failed: %d\n", name, r.err);
+			return r.err;
+		}
+		sum += lat[i];
+
+		msleep(read_interval);
+	}
+
+	sort(lat, reads, sizeof(*lat), ilt_cmp_u32, NULL);
+	pr_info("%s: read latency us: mean %llu, 50%% %u, 90%% %u, 99%% %u, max %u\n",
+		name, div_u64(sum, reads), lat[reads / 2],
+		lat[reads * 9 / 10], lat[reads * 99 / 100], lat[reads - 1]);
+
+	return 0;
+}
+
+static void ilt_stop_writers(void)
+{
+	int i;
+
+	for (i = 0; i < writers; i++) {
+		if (ilt_writers[i])
+			kthread_stop(ilt_writers[i]);
+		ilt_writers[i] = NULL;
+	}
+	wait_event(ilt_wait, !atomic_read(&ilt_inflight));
+}
+
+static int ilt_run(u32 *lat)
+{
+	ktime_t start;
+	s64 us;
+	int i, err;
+
+	err = ilt_read_phase("idle", lat);
+	if (err)
+		return err;
+
+	start = ktime_get();
+	for (i = 0; i < writers; i++) {
+		ilt_writers[i] = kthread_run(ilt_writer, (void *)(unsigned long)i,
+					     "ilt_writer/%d", i);
+		if (IS_ERR(ilt_writers[i])) {
+			err = PTR_ERR(ilt_writers[i]);
+			ilt_writers[i] = NULL;
+			ilt_stop_writers();
+			return err;
+		}
+	}
+
+	/* Let the writes fill the queue before timing reads. */
+	msleep(1000);
+	err = ilt_read_phase("writing", lat);
+	ilt_stop_writers();
+	us = ktime_us_delta(ktime_get(), start);
+
+	pr_info("writing: %lu KB/s written, %d write errors\n",
+		(unsigned long)div64_u64((u64)atomic_long_read(&ilt_written) *
+					 1000000 / 1024, us),
+		atomic_read(&ilt_write_errors));
+
+	return err;
+}
+
+static int __init ilt_init(void)
+{
+	struct request_queue *q;
+	u32 *lat = NULL;
+	int i, err;
+
+	if (!dev) {
+		pr_err("dev= is required; its contents will be overwritten\n");
+		return -EINVAL;
+	}
+	if (!reads || !writers || writers > ILT_MAX_WRITERS || !write_depth ||
+	    write_kb < PAGE_SIZE / 1024 ||
+	    write_kb > ILT_MAX_WRITE_PAGES * (PAGE_SIZE / 1024))
+		return -EINVAL;
+
+	ilt_bdev = blkdev_get_by_path(dev, ILT_MODE, &ilt_bdev);
+	if (IS_ERR(ilt_bdev))
+		return PTR_ERR(ilt_bdev);
+
+	ilt_nr_sects = i_size_read(ilt_bdev->bd_inode) >> 9;
+	if (ilt_nr_sects < 2 * ILT_MAX_WRITERS * ILT_MAX_WRITE_PAGES *
+			   (PAGE_SIZE >> 9)) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	err = -ENOMEM;
+	lat = vmalloc(reads * sizeof(*lat));
+	ilt_read_page = alloc_page(GFP_KERNEL);
+	if (!lat || !ilt_read_page)
+		goto out;
+	for (i = 0; i < ILT_MAX_WRITE_PAGES; i++) {
+		ilt_write_pages[i] = alloc_page(GFP_KERNEL);
+		if (!ilt_write_pages[i])
+			goto out;
+		memset(page_address(ilt_write_pages[i]), 0x5a, PAGE_SIZE);
+	}
+
+	q = bdev_get_queue(ilt_bdev);
+	pr_info("%s, %s scheduler, %u reads every %u ms, %u writers of %u KB, depth %u\n",
+		dev, q->elevator ? q->elevator->elevator_type->elevator_name :
+		"no", reads, read_interval, writers, write_kb, write_depth);
+
+	err = ilt_run(lat);
+
+	/* All the work is done; don't stay loaded. */
+	if (!err)
+		err = -EAGAIN;
+out:
+	for (i = 0; i < ILT_MAX_WRITE_PAGES; i++)
+		if (ilt_write_pages[i])
+			__free_page(ilt_write_pages[i]);
+	if (ilt_read_page)
+		__free_page(ilt_read_page);
+	vfree(lat);
+	blkdev_put(ilt_bdev, ILT_MODE);
+	return err;
+}
+module_init(ilt_init);
+
+module_param(dev, charp, 0);
+MODULE_PARM_DESC(dev, "Block device to test; its contents are overwritten");
+module_param(reads, uint, 0);
+MODULE_PARM_DESC(reads, "Reads timed per phase (default 500)");
+module_param(read_interval, uint, 0);
+MODULE_PARM_DESC(read_interval, "Milliseconds between reads (default 5)");
+module_param(writers, uint, 0);
+MODULE_PARM_DESC(writers, "Writer threads (default 2, at most 8)");
+module_param(write_kb, uint, 0);
+MODULE_PARM_DESC(write_kb, "Size of each write in KB (default 128, at most 256)");
+module_param(write_depth, uint, 0);
+MODULE_PARM_DESC(write_depth, "Writes kept in flight (default 32)");
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("I/O scheduler read latency under write load");
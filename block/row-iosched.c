@@ -0,0 +1,479 @@
+/*
+ *  ROW (READ Over WRITE) i/o scheduler.
+ *
+ *  Synchronous reads are dispatched ahead of writes so that foreground
+ *  reads on eMMC do not wait behind long batches of background writes.
+ *  Writes are still guaranteed a share of every dispatch cycle.
+ *
+ *  See Documentation/block/row-iosched.txt
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/jiffies.h>
+#include <linux/timer.h>
+#include <linux/workqueue.h>
+
+/*
+ * The queues, from the highest dispatch priority to the lowest.  Requests
+ * from RT tasks go to the HIGH queues, those from IDLE tasks to the LOW
+ * ones.  Only synchronous writes are told apart by priority; async
+ * (writeback) writes all share ROWQ_REG_WRITE.
+ */
+enum row_queue_prio {
+	ROWQ_HIGH_READ = 0,
+	ROWQ_HIGH_SWRITE,
+	ROWQ_REG_READ,
+	ROWQ_REG_SWRITE,
+	ROWQ_REG_WRITE,
+	ROWQ_LOW_READ,
+	ROWQ_LOW_SWRITE,
+	ROWQ_MAX_PRIO,
+};
+
+/* default number of requests each queue may dispatch per cycle */
+static const int row_quantum[ROWQ_MAX_PRIO] = {
+	[ROWQ_HIGH_READ]	= 100,
+	[ROWQ_HIGH_SWRITE]	= 2,
+	[ROWQ_REG_READ]		= 75,
+	[ROWQ_REG_SWRITE]	= 2,
+	[ROWQ_REG_WRITE]	= 2,
+	[ROWQ_LOW_READ]		= 1,
+	[ROWQ_LOW_SWRITE]	= 1,
+};
+
+static const int read_idle = 5;		/* ms to wait for the next sequential read */
+static const int read_idle_freq = 8;	/* ... if reads arrived this close together */
+
+struct row_queue {
+	struct list_head fifo;
+	unsigned int nr_req;
+	unsigned int nr_dispatched;	/* in the current cycle */
+	int quantum;
+};
+
+struct row_data {
+	struct request_queue *queue;
+	struct row_queue row_queues[ROWQ_MAX_PRIO];
+
+	/*
+	 * read stream tracking, used to decide whether to hold writes back
+	 * for a moment once the read queues have drained
+	 */
+	sector_t last_read_end;
+	unsigned long last_read_time;
+	unsigned int seq_reads;
+
+	struct timer_list idle_timer;
+	struct work_struct unplug_work;
+	unsigned int idling:1;
+	unsigned int idle_done:1;	/* already idled for this stream */
+
+	/*
+	 * settings
+	 */
+	int read_idle;
+	int read_idle_freq;
+};
+
+#define RQ_ROWQ(rq)		((struct row_queue *)((rq)->elevator_private[0]))
+
+static inline bool row_prio_is_read(enum row_queue_prio prio)
+{
+	return prio == ROWQ_HIGH_READ || prio == ROWQ_REG_READ ||
+		prio == ROWQ_LOW_READ;
+}
+
+static enum row_queue_prio row_get_queue_prio(struct request *rq)
+{
+	const bool sync = rq_is_sync(rq);
+	int ioprio_class = IOPRIO_PRIO_CLASS(req_get_ioprio(rq));
+
+	if (ioprio_class == IOPRIO_CLASS_NONE && current->io_context)
+		ioprio_class = task_ioprio_class(current->io_context);
+
+	if (rq_data_dir(rq) == READ) {
+		switch (ioprio_class) {
+		case IOPRIO_CLASS_RT:
+			return ROWQ_HIGH_READ;
+		case IOPRIO_CLASS_IDLE:
+			return ROWQ_LOW_READ;
+		default:
+			return ROWQ_REG_READ;
+		}
+	}
+
+	if (!sync)
+		return ROWQ_REG_WRITE;
+
+	switch (ioprio_class) {
+	case IOPRIO_CLASS_RT:
+		return ROWQ_HIGH_SWRITE;
+	case IOPRIO_CLASS_IDLE:
+		return ROWQ_LOW_SWRITE;
+	default:
+		return ROWQ_REG_SWRITE;
+	}
+}
+
+/*
+ * Reads that start where the previous one ended and arrive close together
+ * form a sequential stream worth idling for.
+ */
+static void row_track_read(struct row_data *rd, struct request *rq)
+{
+	if (blk_rq_pos(rq) == rd->last_read_end &&
+	    time_before_eq(jiffies, rd->last_read_time + rd->read_idle_freq)) {
+		if (rd->seq_reads < UINT_MAX)
+			rd->seq_reads++;
+	} else {
+		rd->seq_reads = 0;
+	}
+
+	rd->last_read_end = blk_rq_pos(rq) + blk_rq_sectors(rq);
+	rd->last_read_time = jiffies;
+	rd->idle_done = 0;
+}
+
+static void row_add_request(struct request_queue *q, struct request *rq)
+{
+	struct row_data *rd = q->elevator->elevator_data;
+	enum row_queue_prio prio = row_get_queue_prio(rq);
+	struct row_queue *rqueue = &rd->row_queues[prio];
+
+	rq->elevator_private[0] = rqueue;
+	list_add_tail(&rq->queuelist, &rqueue->fifo);
+	rqueue->nr_req++;
+
+	if (row_prio_is_read(prio)) {
+		row_track_read(rd, rq);
+
+		/* the read we were waiting for; the caller runs the queue */
+		if (rd->idling) {
+			rd->idling = 0;
+			del_timer(&rd->idle_timer);
+		}
+	}
+}
+
+static void row_remove_request(struct request *rq)
+{
+	struct row_queue *rqueue = RQ_ROWQ(rq);
+
+	list_del_init(&rq->queuelist);
+	rqueue->nr_req--;
+	rq->elevator_private[0] = NULL;
+}
+
+static void row_merged_requests(struct request_queue *q, struct request *rq,
+				struct request *next)
+{
+	row_remove_request(next);
+}
+
+static struct request *
+row_former_request(struct request_queue *q, struct request *rq)
+{
+	struct row_queue *rqueue = RQ_ROWQ(rq);
+
+	if (!rqueue || rq->queuelist.prev == &rqueue->fifo)
+		return NULL;
+	return list_entry(rq->queuelist.prev, struct request, queuelist);
+}
+
+static struct request *
+row_latter_request(struct request_queue *q, struct request *rq)
+{
+	struct row_queue *rqueue = RQ_ROWQ(rq);
+
+	if (!rqueue || rq->queuelist.next == &rqueue->fifo)
+		return NULL;
+	return list_entry(rq->queuelist.next, struct request, queuelist);
+}
+
+static void row_dispatch_insert(struct request_queue *q,
+				struct row_queue *rqueue)
+{
+	struct request *rq = list_first_entry(&rqueue->fifo, struct request,
+					      queuelist);
+
+	row_remove_request(rq);
+	elv_dispatch_add_tail(q, rq);
+	rqueue->nr_dispatched++;
+}
+
+/*
+ * Pick the highest priority queue that has requests and quantum left.
+ * When every non-empty queue has used up its quantum, a new cycle begins.
+ * Lower queues thus get at least their quantum once per cycle, which
+ * bounds how long writes can be starved by a steady stream of reads.
+ */
+static struct row_queue *row_select_queue(struct row_data *rd)
+{
+	int i, cycle;
+
+	for (cycle = 0; cycle < 2; cycle++) {
+		for (i = 0; i < ROWQ_MAX_PRIO; i++) {
+			struct row_queue *rqueue = &rd->row_queues[i];
+
+			if (rqueue->nr_req &&
+			    rqueue->nr_dispatched < rqueue->quantum)
+				return rqueue;
+		}
+
+		for (i = 0; i < ROWQ_MAX_PRIO; i++)
+			rd->row_queues[i].nr_dispatched = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * Before handing the device to writes, wait briefly if a sequential read
+ * stream has just drained: its next request usually follows within a
+ * millisecond or two and would otherwise queue up behind the writes.
+ */
+static bool row_should_idle(struct row_data *rd, struct row_queue *rqueue)
+{
+	enum row_queue_prio prio = rqueue - rd->row_queues;
+
+	if (!rd->read_idle || rd->idle_done || row_prio_is_read(prio))
+		return false;
+	if (prio < ROWQ_REG_READ)
+		return false;
+	/* reads still queued but out of quantum: let the writes through */
+	if (rd->row_queues[ROWQ_HIGH_READ].nr_req ||
+	    rd->row_queues[ROWQ_REG_READ].nr_req)
+		return false;
+	if (rd->seq_reads < 2)
+		return false;
+
+	return time_before_eq(jiffies, rd->last_read_time + rd->read_idle_freq);
+}
+
+static int row_dispatch_requests(struct request_queue *q, int force)
+{
+	struct row_data *rd = q->elevator->elevator_data;
+	struct row_queue *rqueue;
+	int i, dispatched = 0;
+
+	if (unlikely(force)) {
+		if (rd->idling) {
+			rd->idling = 0;
+			del_timer(&rd->idle_timer);
+		}
+		for (i = 0; i < ROWQ_MAX_PRIO; i++) {
+			rqueue = &rd->row_queues[i];
+			while (rqueue->nr_req) {
+				row_dispatch_insert(q, rqueue);
+				dispatched++;
+			}
+		}
+		return dispatched;
+	}
+
+	if (rd->idling)
+		return 0;
+
+	rqueue = row_select_queue(rd);
+	if (!rqueue)
+		return 0;
+
+	if (row_should_idle(rd, rqueue)) {
+		rd->idling = 1;
+		rd->idle_done = 1;
+		mod_timer(&rd->idle_timer, jiffies + rd->read_idle);
+		return 0;
+	}
+
+	row_dispatch_insert(q, rqueue);
+	return 1;
+}
+
+static void row_kick_queue(struct work_struct *work)
+{
+	struct row_data *rd = container_of(work, struct row_data, unplug_work);
+	struct request_queue *q = rd->queue;
+
+	spin_lock_irq(q->queue_lock);
+	__blk_run_queue(q);
+	spin_unlock_irq(q->queue_lock);
+}
+
+static void row_idle_timer(unsigned long data)
+{
+	struct row_data *rd = (struct row_data *)data;
+	struct request_queue *q = rd->queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	if (rd->idling) {
+		rd->idling = 0;
+		kblockd_schedule_work(q, &rd->unplug_work);
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+}
+
+static void row_exit_queue(struct elevator_queue *e)
+{
+	struct row_data *rd = e->elevator_data;
+	int i;
+
+	del_timer_sync(&rd->idle_timer);
+	cancel_work_sync(&rd->unplug_work);
+
+	for (i = 0; i < ROWQ_MAX_PRIO; i++)
+		BUG_ON(!list_empty(&rd->row_queues[i].fifo));
+
+	kfree(rd);
+}
+
+static void *row_init_queue(struct request_queue *q)
+{
+	struct row_data *rd;
+	int i;
+
+	rd = kmalloc_node(sizeof(*rd), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!rd)
+		return NULL;
+
+	for (i = 0; i < ROWQ_MAX_PRIO; i++) {
+		INIT_LIST_HEAD(&rd->row_queues[i].fifo);
+		rd->row_queues[i].quantum = row_quantum[i];
+	}
+
+	rd->queue = q;
+	init_timer(&rd->idle_timer);
+	rd->idle_timer.function = row_idle_timer;
+	rd->idle_timer.data = (unsigned long)rd;
+	INIT_WORK(&rd->unplug_work, row_kick_queue);
+
+	rd->read_idle = msecs_to_jiffies(read_idle);
+	rd->read_idle_freq = msecs_to_jiffies(read_idle_freq);
+	return rd;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+row_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+row_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct row_data *rd = e->elevator_data;				\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return row_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(row_high_read_quantum_show, rd->row_queues[ROWQ_HIGH_READ].quantum, 0);
+SHOW_FUNCTION(row_high_swrite_quantum_show, rd->row_queues[ROWQ_HIGH_SWRITE].quantum, 0);
+SHOW_FUNCTION(row_reg_read_quantum_show, rd->row_queues[ROWQ_REG_READ].quantum, 0);
+SHOW_FUNCTION(row_reg_swrite_quantum_show, rd->row_queues[ROWQ_REG_SWRITE].quantum, 0);
+SHOW_FUNCTION(row_reg_write_quantum_show, rd->row_queues[ROWQ_REG_WRITE].quantum, 0);
+SHOW_FUNCTION(row_low_read_quantum_show, rd->row_queues[ROWQ_LOW_READ].quantum, 0);
+SHOW_FUNCTION(row_low_swrite_quantum_show, rd->row_queues[ROWQ_LOW_SWRITE].quantum, 0);
+SHOW_FUNCTION(row_read_idle_show, rd->read_idle, 1);
+SHOW_FUNCTION(row_read_idle_freq_show, rd->read_idle_freq, 1);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct row_data *rd = e->elevator_data;				\
+	int __data;							\
+	int ret = row_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(row_high_read_quantum_store, &rd->row_queues[ROWQ_HIGH_READ].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_high_swrite_quantum_store, &rd->row_queues[ROWQ_HIGH_SWRITE].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_reg_read_quantum_store, &rd->row_queues[ROWQ_REG_READ].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_reg_swrite_quantum_store, &rd->row_queues[ROWQ_REG_SWRITE].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_reg_write_quantum_store, &rd->row_queues[ROWQ_REG_WRITE].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_low_read_quantum_store, &rd->row_queues[ROWQ_LOW_READ].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_low_swrite_quantum_store, &rd->row_queues[ROWQ_LOW_SWRITE].quantum, 1, INT_MAX, 0);
+STORE_FUNCTION(row_read_idle_store, &rd->read_idle, 0, INT_MAX, 1);
+STORE_FUNCTION(row_read_idle_freq_store, &rd->read_idle_freq, 1, INT_MAX, 1);
+#undef STORE_FUNCTION
+
+#define ROW_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, row_##name##_show, \
+				      row_##name##_store)
+
+static struct elv_fs_entry row_attrs[] = {
+	ROW_ATTR(high_read_quantum),
+	ROW_ATTR(high_swrite_quantum),
+	ROW_ATTR(reg_read_quantum),
+	ROW_ATTR(reg_swrite_quantum),
+	ROW_ATTR(reg_write_quantum),
+	ROW_ATTR(low_read_quantum),
+	ROW_ATTR(low_swrite_quantum),
+	ROW_ATTR(read_idle),
+	ROW_ATTR(read_idle_freq),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_row = {
+	.ops = {
+		.elevator_merge_req_fn =	row_merged_requests,
+		.elevator_dispatch_fn =		row_dispatch_requests,
+		.elevator_add_req_fn =		row_add_request,
+		.elevator_former_req_fn =	row_former_request,
+		.elevator_latter_req_fn =	row_latter_request,
+		.elevator_init_fn =		row_init_queue,
+		.elevator_exit_fn =		row_exit_queue,
+	},
+
+	.elevator_attrs = row_attrs,
+	.elevator_name = "row",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init row_init(void)
+{
+	elv_register(&iosched_row);
+
+	return 0;
+}
+
+static void __exit row_exit(void)
+{
+	elv_unregister(&iosched_row);
+}
+
+module_init(row_init);
+module_exit(row_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("ROW (READ Over WRITE) IO scheduler");
@@ -1469,6 +1469,22 @@ int __cpufreq_driver_getavg(struct cpufreq_policy *policy, unsigned int cpu)
 }
 EXPORT_SYMBOL_GPL(__cpufreq_driver_getavg);
 
+/*
+ * Drivers may clamp targets below policy->max on their own, e.g. for
+ * thermal reasons. Governors use this to avoid asking for frequencies
+ * that would only be clamped.
+ */
+unsigned int __cpufreq_driver_get_limit(struct cpufreq_policy *policy)
+{
+	unsigned int limit = policy->max;
+
+	if (cpufreq_driver && cpufreq_driver->get_limit)
+		limit = min(limit, cpufreq_driver->get_limit(policy));
+
+	return limit;
+}
+EXPORT_SYMBOL_GPL(__cpufreq_driver_get_limit);
+
 /*
  * when "event" is CPUFREQ_GOV_LIMITS
  */
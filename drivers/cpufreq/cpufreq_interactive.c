@@ -19,6 +19,7 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/rwsem.h>
@@ -102,6 +103,27 @@ static int boostpulse_duration_val = DEFAULT_MIN_SAMPLE_TIME;
 /* End time of boost pulse in ktime converted to usecs */
 static u64 boostpulse_endtime;
 
+/* Boost to hispeed_freq on input events, for this many usecs */
+#define DEFAULT_INPUT_BOOST_DURATION (200 * USEC_PER_MSEC)
+static int input_boost_val = 1;
+static int input_boost_duration_val = DEFAULT_INPUT_BOOST_DURATION;
+/* Time of the input event that started the pending ramp, or 0 */
+static u64 input_boost_start;
+static unsigned long input_boost_count;
+static u64 input_boost_latency_total;
+static u64 input_boost_latency_max;
+
+/* Time spent at each frequency while the governor is active, in usecs */
+#define MAX_RESIDENCY_FREQS 32
+static spinlock_t residency_lock;
+static struct {
+	unsigned int freq;
+	u64 time;
+} residency[MAX_RESIDENCY_FREQS];
+static int nresidency;
+static unsigned int residency_freq;
+static u64 residency_timestamp;
+
 /*
  * Max additional time to wait in idle, beyond timer_rate, at speeds above
  * minimum before wakeup to reduce speed, or -1 if unnecessary.
@@ -122,6 +144,27 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+static void cpufreq_interactive_account_residency(unsigned int new_freq)
+{
+	unsigned long flags;
+	u64 now = ktime_to_us(ktime_get());
+	int i;
+
+	spin_lock_irqsave(&residency_lock, flags);
+	if (residency_freq) {
+		for (i = 0; i < nresidency; i++)
+			if (residency[i].freq == residency_freq)
+				break;
+		if (i == nresidency && nresidency < MAX_RESIDENCY_FREQS)
+			residency[nresidency++].freq = residency_freq;
+		if (i < nresidency)
+			residency[i].time += now - residency_timestamp;
+	}
+	residency_freq = new_freq;
+	residency_timestamp = now;
+	spin_unlock_irqrestore(&residency_lock, flags);
+}
+
 static void cpufreq_interactive_timer_resched(
 	struct cpufreq_interactive_cpuinfo *pcpu)
 {
@@ -278,6 +321,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 	unsigned int new_freq;
 	unsigned int loadadjfreq;
 	unsigned int index;
+	unsigned int limit;
+	unsigned int relation = CPUFREQ_RELATION_L;
 	unsigned long flags;
 	bool boosted;
 
@@ -317,6 +362,16 @@ static void cpufreq_interactive_timer(unsigned long data)
 		new_freq = choose_freq(pcpu, loadadjfreq);
 	}
 
+	/*
+	 * Don't ask for more than the driver is going to grant, it would
+	 * only be clamped behind our back.
+	 */
+	limit = __cpufreq_driver_get_limit(pcpu->policy);
+	if (new_freq >= limit) {
+		new_freq = limit;
+		relation = CPUFREQ_RELATION_H;
+	}
+
 	if (pcpu->target_freq >= hispeed_freq &&
 	    new_freq > pcpu->target_freq &&
 	    now - pcpu->hispeed_validate_time < above_hispeed_delay_val) {
@@ -329,7 +384,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 	pcpu->hispeed_validate_time = now;
 
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
-					   new_freq, CPUFREQ_RELATION_L,
+					   new_freq, relation,
 					   &index)) {
 		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
 			     (int) data);
@@ -514,7 +569,7 @@ static int cpufreq_interactive_speedchange_task(void *data)
 	return 0;
 }
 
-static void cpufreq_interactive_boost(void)
+static int cpufreq_interactive_boost(void)
 {
 	int i;
 	int anyboost = 0;
@@ -524,10 +579,15 @@ static void cpufreq_interactive_boost(void)
 	spin_lock_irqsave(&speedchange_cpumask_lock, flags);
 
 	for_each_online_cpu(i) {
+		unsigned int boost_freq = hispeed_freq;
+
 		pcpu = &per_cpu(cpuinfo, i);
+		if (pcpu->policy)
+			boost_freq = min(boost_freq,
+					 __cpufreq_driver_get_limit(pcpu->policy));
 
-		if (pcpu->target_freq < hispeed_freq) {
-			pcpu->target_freq = hispeed_freq;
+		if (pcpu->target_freq < boost_freq) {
+			pcpu->target_freq = boost_freq;
 			cpumask_set_cpu(i, &speedchange_cpumask);
 			pcpu->hispeed_validate_time =
 				ktime_to_us(ktime_get());
@@ -539,7 +599,7 @@ static void cpufreq_interactive_boost(void)
 		 * validated.
 		 */
 
-		pcpu->floor_freq = hispeed_freq;
+		pcpu->floor_freq = boost_freq;
 		pcpu->floor_validate_time = ktime_to_us(ktime_get());
 	}
 
@@ -547,6 +607,8 @@ static void cpufreq_interactive_boost(void)
 
 	if (anyboost)
 		wake_up_process(speedchange_task);
+
+	return anyboost;
 }
 
 static int cpufreq_interactive_notifier(
@@ -574,6 +636,21 @@ static int cpufreq_interactive_notifier(
 			spin_unlock_irqrestore(&pjcpu->load_lock, flags);
 		}
 
+		if (freq->cpu == pcpu->policy->cpu) {
+			cpufreq_interactive_account_residency(freq->new);
+
+			if (input_boost_start && freq->new >= hispeed_freq) {
+				u64 latency = ktime_to_us(ktime_get()) -
+					input_boost_start;
+
+				input_boost_start = 0;
+				input_boost_count++;
+				input_boost_latency_total += latency;
+				if (latency > input_boost_latency_max)
+					input_boost_latency_max = latency;
+			}
+		}
+
 		up_read(&pcpu->enable_sem);
 	}
 	return 0;
@@ -866,6 +943,91 @@ static ssize_t store_boostpulse_duration(
 
 define_one_global_rw(boostpulse_duration);
 
+static ssize_t show_input_boost(struct kobject *kobj, struct attribute *attr,
+				char *buf)
+{
+	return sprintf(buf, "%d\n", input_boost_val);
+}
+
+static ssize_t store_input_boost(struct kobject *kobj, struct attribute *attr,
+				 const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	input_boost_val = val;
+	return count;
+}
+
+define_one_global_rw(input_boost);
+
+static ssize_t show_input_boost_duration(
+	struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", input_boost_duration_val);
+}
+
+static ssize_t store_input_boost_duration(
+	struct kobject *kobj, struct attribute *attr, const char *buf,
+	size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = kstrtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+
+	input_boost_duration_val = val;
+	return count;
+}
+
+define_one_global_rw(input_boost_duration);
+
+/* Input event to hispeed_freq reached: count, average and max in usecs */
+static ssize_t show_input_boost_latency(
+	struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	u64 avg = input_boost_latency_total;
+
+	if (input_boost_count)
+		do_div(avg, input_boost_count);
+	else
+		avg = 0;
+
+	return sprintf(buf, "%lu %llu %llu\n", input_boost_count, avg,
+		       input_boost_latency_max);
+}
+
+static struct global_attr input_boost_latency =
+	__ATTR(input_boost_latency, 0444, show_input_boost_latency, NULL);
+
+static ssize_t show_residency(
+	struct kobject *kobj, struct attribute *attr, char *buf)
+{
+	unsigned long flags;
+	ssize_t ret = 0;
+	int i;
+
+	/* fold in the time spent at the current speed so far */
+	cpufreq_interactive_account_residency(residency_freq);
+
+	spin_lock_irqsave(&residency_lock, flags);
+	for (i = 0; i < nresidency; i++)
+		ret += sprintf(buf + ret, "%u %llu\n", residency[i].freq,
+			       residency[i].time);
+	spin_unlock_irqrestore(&residency_lock, flags);
+
+	return ret;
+}
+
+static struct global_attr residency_attr =
+	__ATTR(residency, 0444, show_residency, NULL);
+
 static struct attribute *interactive_attributes[] = {
 	&target_loads_attr.attr,
 	&hispeed_freq_attr.attr,
@@ -877,6 +1039,10 @@ static struct attribute *interactive_attributes[] = {
 	&boost.attr,
 	&boostpulse.attr,
 	&boostpulse_duration.attr,
+	&input_boost.attr,
+	&input_boost_duration.attr,
+	&input_boost_latency.attr,
+	&residency_attr.attr,
 	NULL,
 };
 
@@ -905,6 +1071,108 @@ static struct notifier_block cpufreq_interactive_idle_nb = {
 	.notifier_call = cpufreq_interactive_idle_notifier,
 };
 
+#ifdef CONFIG_INPUT
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+					    unsigned int type,
+					    unsigned int code, int value)
+{
+	u64 now;
+	bool boosted;
+
+	if (!input_boost_val || type == EV_SYN)
+		return;
+
+	now = ktime_to_us(ktime_get());
+	boosted = now < boostpulse_endtime;
+	if (now + input_boost_duration_val > boostpulse_endtime)
+		boostpulse_endtime = now + input_boost_duration_val;
+
+	/* a running boost is only extended */
+	if (boosted)
+		return;
+
+	trace_cpufreq_interactive_boost("input");
+	if (!input_boost_start)
+		input_boost_start = now;
+	/* nothing to ramp, don't count it */
+	if (!cpufreq_interactive_boost())
+		input_boost_start = 0;
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+					     struct input_dev *dev,
+					     const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err_register;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err_open;
+
+	return 0;
+
+err_open:
+	input_unregister_handle(handle);
+err_register:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	/* multi-touch touchscreens */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	/* single-touch touchscreens and touchpads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	/* keys and keypads */
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+#endif
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
 {
@@ -977,9 +1245,15 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			return rc;
 		}
 
+		cpufreq_interactive_account_residency(policy->cur);
 		idle_notifier_register(&cpufreq_interactive_idle_nb);
 		cpufreq_register_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
+#ifdef CONFIG_INPUT
+		if (input_register_handler(&cpufreq_interactive_input_handler))
+			pr_warn("%s: failed to register input handler\n",
+				__func__);
+#endif
 		mutex_unlock(&gov_lock);
 		break;
 
@@ -999,9 +1273,13 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			return 0;
 		}
 
+#ifdef CONFIG_INPUT
+		input_unregister_handler(&cpufreq_interactive_input_handler);
+#endif
 		cpufreq_unregister_notifier(
 			&cpufreq_notifier_block, CPUFREQ_TRANSITION_NOTIFIER);
 		idle_notifier_unregister(&cpufreq_interactive_idle_nb);
+		cpufreq_interactive_account_residency(0);
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 		mutex_unlock(&gov_lock);
@@ -1043,6 +1321,7 @@ static int __init cpufreq_interactive_init(void)
 	}
 
 	spin_lock_init(&target_loads_lock);
+	spin_lock_init(&residency_lock);
 	spin_lock_init(&speedchange_cpumask_lock);
 	mutex_init(&gov_lock);
 	speedchange_task =
@@ -28,6 +28,12 @@
 #include <asm/mach/map.h>
 #include <linux/dma-mapping.h>
 #include <asm/cacheflush.h>
+#ifdef CONFIG_PLAT_RK
+#include <plat/board.h>
+#else
+static inline int board_cma_claim(phys_addr_t base, size_t size) { return 0; }
+static inline void board_cma_release(phys_addr_t base, size_t size) {}
+#endif
 #include "ion_priv.h"
 
 struct ion_carveout_heap {
@@ -62,6 +68,12 @@ ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 		return ION_CARVEOUT_ALLOCATE_FAIL;
 	}
 
+	/* the heap may be lent to movable pages, take the range back */
+	if (board_cma_claim(offset, size)) {
+		gen_pool_free(carveout_heap->pool, offset, size);
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+	}
+
 	heap->allocated_size += size;
 
 	if((offset + size - carveout_heap->base) > heap->max_allocated)
@@ -80,6 +92,7 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
+	board_cma_release(addr, size);
 	gen_pool_free(carveout_heap->pool, addr, size);
 
 	heap->allocated_size -= size;
@@ -125,9 +138,45 @@ void ion_carveout_heap_unmap_dma(struct ion_heap *heap,
 	return;
 }
 
+/*
+ * A heap lent to the page allocator is ordinary RAM, which ARM refuses to
+ * ioremap.  It also stays in the cacheable linear map, and ARMv7 forbids
+ * mapping the same page with other memory attributes, so vmap it cacheable
+ * and keep the device's view coherent by hand: flush on map so the CPU
+ * doesn't read stale lines, and on unmap so the device sees CPU writes.
+ */
+static void ion_carveout_heap_flush(struct ion_buffer *buffer, void *vaddr)
+{
+	dmac_flush_range(vaddr, vaddr + buffer->size);
+	outer_flush_range(buffer->priv_phys, buffer->priv_phys + buffer->size);
+}
+
+static void *ion_carveout_heap_vmap(struct ion_buffer *buffer)
+{
+	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	unsigned long pfn = __phys_to_pfn(buffer->priv_phys);
+	struct page **pages;
+	void *vaddr;
+	int i;
+
+	pages = vmalloc(sizeof(struct page *) * npages);
+	if (!pages)
+		return NULL;
+	for (i = 0; i < npages; i++)
+		pages[i] = pfn_to_page(pfn + i);
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	vfree(pages);
+	if (vaddr)
+		ion_carveout_heap_flush(buffer, vaddr);
+
+	return vaddr;
+}
+
 void *ion_carveout_heap_map_kernel(struct ion_heap *heap,
 				   struct ion_buffer *buffer)
 {
+	if (pfn_valid(__phys_to_pfn(buffer->priv_phys)))
+		return ion_carveout_heap_vmap(buffer);
 	return __arch_ioremap(buffer->priv_phys, buffer->size,
 			      MT_MEMORY_NONCACHED);
 }
@@ -135,7 +184,12 @@ void *ion_carveout_heap_map_kernel(struct ion_heap *heap,
 void ion_carveout_heap_unmap_kernel(struct ion_heap *heap,
 				    struct ion_buffer *buffer)
 {
-	__arch_iounmap(buffer->vaddr);
+	if (pfn_valid(__phys_to_pfn(buffer->priv_phys))) {
+		ion_carveout_heap_flush(buffer, buffer->vaddr);
+		vunmap(buffer->vaddr);
+	} else {
+		__arch_iounmap(buffer->vaddr);
+	}
 	buffer->vaddr = NULL;
 	return;
 }
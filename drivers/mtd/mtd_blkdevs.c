@@ -108,6 +108,9 @@ static int do_blktrans_request(struct mtd_blktrans_ops *tr,
 	if (req->cmd_type != REQ_TYPE_FS)
 		return -EIO;
 
+	if (req->cmd_flags & REQ_FLUSH)
+		return tr->flush ? tr->flush(dev) : 0;
+
 	if (blk_rq_pos(req) + blk_rq_cur_sectors(req) >
 	    get_capacity(req->rq_disk))
 		return -EIO;
@@ -305,6 +308,18 @@ static int mtd_blktrans_thread(void *arg)
 		    background_done = 0;
 	        continue;
     	}
+		if (req->cmd_flags & REQ_FLUSH) {
+			/* empty cache flush, data parts come as separate requests */
+			spin_unlock_irq(rq->queue_lock);
+			mutex_lock(&dev->lock);
+			res = tr->flush ? tr->flush(dev) : 0;
+			mutex_unlock(&dev->lock);
+			spin_lock_irq(rq->queue_lock);
+			__blk_end_request_all(req, res);
+			req = NULL;
+			background_done = 0;
+			continue;
+		}
 		spin_unlock_irq(rq->queue_lock);
         mutex_lock(&dev->lock);
         
@@ -672,6 +687,10 @@ int add_mtd_blktrans_dev(struct mtd_blktrans_dev *new)
 	blk_queue_max_segments(new->rq, MTD_RW_SECTORS);// /PAGE_CACHE_SIZE
 #endif
 
+	/* FUA is emulated by the block layer with a flush after the write */
+	if (tr->flush)
+		blk_queue_flush(new->rq, REQ_FLUSH);
+
 	if (tr->discard) {
 		queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, new->rq);
 		new->rq->limits.max_discard_sectors = UINT_MAX;
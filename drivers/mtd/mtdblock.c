@@ -379,6 +379,8 @@ static int mtdblock_flush(struct mtd_blktrans_dev *dev)
 	write_cached_data(mtdblk);
 	mutex_unlock(&mtdblk->cache_mutex);
 
+	if (dev->mtd->flush)
+		return dev->mtd->flush(dev->mtd);
 	if (dev->mtd->sync)
 		dev->mtd->sync(dev->mtd);
 	return 0;
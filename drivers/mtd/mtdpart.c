@@ -310,6 +310,12 @@ static void part_sync(struct mtd_info *mtd)
 	part->master->sync(part->master);
 }
 
+static int part_flush(struct mtd_info *mtd)
+{
+	struct mtd_part *part = PART(mtd);
+	return part->master->flush(part->master);
+}
+
 static int part_suspend(struct mtd_info *mtd)
 {
 	struct mtd_part *part = PART(mtd);
@@ -447,6 +453,8 @@ static struct mtd_part *allocate_partition(struct mtd_info *master,
 		slave->mtd.get_fact_prot_info = part_get_fact_prot_info;
 	if (master->sync)
 		slave->mtd.sync = part_sync;
+	if (master->flush)
+		slave->mtd.flush = part_flush;
 	if (!partno && !master->dev.class && master->suspend && master->resume) {
 			slave->mtd.suspend = part_suspend;
 			slave->mtd.resume = part_resume;
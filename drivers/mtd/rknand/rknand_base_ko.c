@@ -24,6 +24,9 @@
 #include "rknand_base.h"
 #include <linux/clk.h>
 #include <linux/cpufreq.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
 
 #define DRIVER_NAME	"rk29xxnand"
 
@@ -120,6 +123,562 @@ static int rkNand_trac_read(char *page, char **start, off_t off, int count, int
 long grknand_buf[MAX_BUFFER_SIZE * 512/4] __attribute__((aligned(4096)));
 long grknand_dma_buf[PAGE_LEN*4*5] __attribute__((aligned(4096)));
 
+#ifdef CONFIG_MTD_RKNAND_SECTOR_CACHE
+/*
+ * Sector cache in front of the FTL.
+ *
+ * The mtd block layer hands every request straight to ftl_read/ftl_write,
+ * so each small write costs a full FTL write and sequential reads go to
+ * flash one request at a time. Keep a write-back cache of 4KB FTL pages:
+ * writes land in the cache and are written back as contiguous runs when
+ * a page is evicted, cache_writeback_ms after they were cached, on sync
+ * (which REQ_FLUSH from the mtd block layer ends up in), suspend and
+ * shutdown, or from the panic path. Sectors stay dirty until ftl_write
+ * has succeeded for them, so a failed write back is retried later.
+ * Sequential reads pull in a read-ahead window along with the missing
+ * sectors. Writes to the system image area and large writes go straight
+ * to the FTL and then refresh whatever they overlap in the cache.
+ *
+ * The cache only talks to the FTL through gpNandInfo->ftl_read/ftl_write,
+ * so it can be exercised against a RAM backed stub registered in their
+ * place; /proc/rknand reports hit rates and FTL throughput.
+ */
+#define RKNAND_CACHE_PAGE_SECS	8
+#define RKNAND_CACHE_PAGE_SIZE	(RKNAND_CACHE_PAGE_SECS * 512)
+#define RKNAND_CACHE_HASH	64
+#define RKNAND_CACHE_RUN_SECS	128	/* longest run per ftl_read/ftl_write */
+#define RKNAND_CACHE_NO_INDEX	(~0U)
+
+struct rknand_cache_page {
+	struct list_head	lru;
+	struct hlist_node	hash;
+	unsigned int		index;		/* lba / RKNAND_CACHE_PAGE_SECS */
+	u8			valid;		/* one bit per sector */
+	u8			dirty;
+	char			*data;
+};
+
+struct rknand_cache_stats {
+	unsigned long		read_hit_secs;
+	unsigned long		read_miss_secs;
+	unsigned long		ra_secs;
+	unsigned long		write_secs;
+	unsigned long		write_bypass_secs;
+	unsigned long		wb_runs;
+	unsigned long		wb_secs;
+	unsigned long		wb_errors;
+	unsigned long		flushes;
+	unsigned long		ftl_read_secs;
+	unsigned long		ftl_write_secs;
+	u64			ftl_read_ns;
+	u64			ftl_write_ns;
+};
+
+static struct rknand_cache {
+	struct mutex		lock;
+	int			enabled;
+	struct rknand_cache_page *pages;
+	char			*data;
+	struct list_head	lru;		/* most recently used first */
+	struct hlist_head	hash[RKNAND_CACHE_HASH];
+	char			*wb_buf;
+	char			*rd_buf;
+	unsigned int		ra_next;	/* lba following the last read */
+	struct delayed_work	flush_work;
+	struct rknand_cache_stats stats;
+} rknand_cache;
+
+static int rknand_cache_pages = 256;
+module_param_named(cache_pages, rknand_cache_pages, int, S_IRUGO);
+MODULE_PARM_DESC(cache_pages, "FTL sector cache size in 4KB pages, 0 disables the cache");
+
+static int rknand_cache_ra_secs = 64;
+module_param_named(cache_readahead, rknand_cache_ra_secs, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_readahead, "sequential read-ahead window in sectors");
+
+static int rknand_cache_bypass_secs = 128;
+module_param_named(cache_bypass, rknand_cache_bypass_secs, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_bypass, "writes of at least this many sectors go straight to the FTL");
+
+static int rknand_cache_writeback_ms = 1000;
+module_param_named(cache_writeback_ms, rknand_cache_writeback_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_writeback_ms, "dirty sectors are written back at most this long after being cached");
+
+static int rknand_ftl_read(unsigned int lba, int nsec, void *buf)
+{
+	struct rknand_cache_stats *st = &rknand_cache.stats;
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = gpNandInfo->ftl_read(lba, nsec, buf);
+	st->ftl_read_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	st->ftl_read_secs += nsec;
+	return ret;
+}
+
+static int rknand_ftl_write(unsigned int lba, int nsec, void *buf)
+{
+	struct rknand_cache_stats *st = &rknand_cache.stats;
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = gpNandInfo->ftl_write(lba, nsec, buf, lba < SysImageWriteEndAdd);
+	st->ftl_write_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	st->ftl_write_secs += nsec;
+	return ret;
+}
+
+static struct rknand_cache_page *rknand_cache_find(unsigned int index)
+{
+	struct rknand_cache_page *p;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(p, n, &rknand_cache.hash[index % RKNAND_CACHE_HASH], hash)
+		if (p->index == index)
+			return p;
+	return NULL;
+}
+
+static struct rknand_cache_page *rknand_cache_dirty_page(unsigned int lba)
+{
+	struct rknand_cache_page *p = rknand_cache_find(lba / RKNAND_CACHE_PAGE_SECS);
+
+	if (p && (p->dirty & (1 << (lba % RKNAND_CACHE_PAGE_SECS))))
+		return p;
+	return NULL;
+}
+
+/*
+ * Write back one contiguous run of dirty sectors containing the first
+ * dirty sector of @p. The run is extended backwards and forwards across
+ * neighbouring cached pages so that merged writes reach the FTL as one
+ * request.
+ */
+static int rknand_cache_write_run(struct rknand_cache_page *p, int panic)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *q;
+	unsigned int start, lba;
+	int n = 0, ret;
+
+	start = p->index * RKNAND_CACHE_PAGE_SECS + __ffs(p->dirty);
+	while (start > 0 && n < RKNAND_CACHE_RUN_SECS / 2 &&
+	       rknand_cache_dirty_page(start - 1)) {
+		start--;
+		n++;
+	}
+
+	n = 0;
+	lba = start;
+	while (n < RKNAND_CACHE_RUN_SECS && (q = rknand_cache_dirty_page(lba))) {
+		int s = lba % RKNAND_CACHE_PAGE_SECS;
+
+		memcpy(c->wb_buf + n * 512, q->data + s * 512, 512);
+		n++;
+		lba++;
+	}
+
+	if (panic)
+		ret = gpNandInfo->ftl_write_panic(start, n, c->wb_buf);
+	else
+		ret = rknand_ftl_write(start, n, c->wb_buf);
+	c->stats.wb_runs++;
+	c->stats.wb_secs += n;
+	if (ret) {
+		/* leave the run dirty, it is retried by the next write back */
+		c->stats.wb_errors++;
+		if (printk_ratelimit())
+			printk(KERN_ERR "rknand: cache write back of %d sectors at %u failed: %d\n",
+			       n, start, ret);
+		return ret;
+	}
+
+	for (lba = start; lba < start + n; lba++) {
+		q = rknand_cache_find(lba / RKNAND_CACHE_PAGE_SECS);
+		q->dirty &= ~(1 << (lba % RKNAND_CACHE_PAGE_SECS));
+	}
+	return 0;
+}
+
+static int rknand_cache_writeback(struct rknand_cache_page *p, int panic)
+{
+	int ret;
+
+	while (p->dirty) {
+		ret = rknand_cache_write_run(p, panic);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/* Returns the number of pages that are still dirty afterwards. */
+static int rknand_cache_flush_locked(int panic)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *p;
+	int failed = 0;
+
+	list_for_each_entry(p, &c->lru, lru)
+		if (p->dirty && rknand_cache_writeback(p, panic))
+			failed++;
+	c->stats.flushes++;
+	return failed;
+}
+
+static void rknand_cache_schedule_flush(void)
+{
+	queue_delayed_work(system_freezable_wq, &rknand_cache.flush_work,
+			   msecs_to_jiffies(rknand_cache_writeback_ms));
+}
+
+/* Returns -EIO if some data could not be written back. */
+static int rknand_cache_flush(void)
+{
+	int failed;
+
+	if (!rknand_cache.enabled || !gpNandInfo->ftl_write)
+		return 0;
+	mutex_lock(&rknand_cache.lock);
+	failed = rknand_cache_flush_locked(0);
+	mutex_unlock(&rknand_cache.lock);
+	if (failed) {
+		rknand_cache_schedule_flush();
+		return -EIO;
+	}
+	return 0;
+}
+
+static void rknand_cache_flush_work(struct work_struct *work)
+{
+	rknand_cache_flush();
+}
+
+/*
+ * Look up @index, recycling the least recently used page on a miss.
+ * Returns NULL if that page could not be written back.
+ */
+static struct rknand_cache_page *rknand_cache_get(unsigned int index)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *p = rknand_cache_find(index);
+
+	if (!p) {
+		p = list_entry(c->lru.prev, struct rknand_cache_page, lru);
+		if (p->dirty && rknand_cache_writeback(p, 0)) {
+			/* keep its data, try another victim next time */
+			list_move(&p->lru, &c->lru);
+			return NULL;
+		}
+		if (p->index != RKNAND_CACHE_NO_INDEX)
+			hlist_del(&p->hash);
+		p->index = index;
+		p->valid = 0;
+		p->dirty = 0;
+		hlist_add_head(&p->hash, &c->hash[index % RKNAND_CACHE_HASH]);
+	}
+	list_move(&p->lru, &c->lru);
+	return p;
+}
+
+/*
+ * Copy data that went to the FTL directly into the pages it overlaps,
+ * so the cache never holds anything older than the flash. Only called
+ * once ftl_write has succeeded, as it clears the dirty bits.
+ */
+static void rknand_cache_update(unsigned int lba, int nsec, const u_char *buf)
+{
+	struct rknand_cache_page *p;
+
+	while (nsec) {
+		int s = lba % RKNAND_CACHE_PAGE_SECS;
+		int n = min(nsec, RKNAND_CACHE_PAGE_SECS - s);
+		u8 mask = ((1 << n) - 1) << s;
+
+		p = rknand_cache_find(lba / RKNAND_CACHE_PAGE_SECS);
+		if (p) {
+			memcpy(p->data + s * 512, buf, n * 512);
+			p->valid |= mask;
+			p->dirty &= ~mask;
+		}
+		lba += n;
+		buf += n * 512;
+		nsec -= n;
+	}
+}
+
+static int rknand_cache_write(unsigned int lba, int nsec, const u_char *buf)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *p;
+	int ret = 0;
+
+	mutex_lock(&c->lock);
+	if (nsec >= rknand_cache_bypass_secs || lba < SysImageWriteEndAdd) {
+		ret = rknand_ftl_write(lba, nsec, (void *)buf);
+		if (!ret)
+			rknand_cache_update(lba, nsec, buf);
+		c->stats.write_bypass_secs += nsec;
+		goto out;
+	}
+
+	c->stats.write_secs += nsec;
+	while (nsec) {
+		int s = lba % RKNAND_CACHE_PAGE_SECS;
+		int n = min(nsec, RKNAND_CACHE_PAGE_SECS - s);
+		u8 mask = ((1 << n) - 1) << s;
+
+		p = rknand_cache_get(lba / RKNAND_CACHE_PAGE_SECS);
+		if (p) {
+			memcpy(p->data + s * 512, buf, n * 512);
+			p->valid |= mask;
+			p->dirty |= mask;
+		} else {
+			/* not cached at all, so the FTL copy is the only one */
+			ret = rknand_ftl_write(lba, n, (void *)buf);
+			if (ret)
+				break;
+		}
+		lba += n;
+		buf += n * 512;
+		nsec -= n;
+	}
+	rknand_cache_schedule_flush();
+out:
+	mutex_unlock(&c->lock);
+	return ret;
+}
+
+/* Bring the sectors of a partially valid page in from the FTL. */
+static int rknand_cache_fill(struct rknand_cache_page *p)
+{
+	struct rknand_cache *c = &rknand_cache;
+	int s, ret;
+
+	ret = rknand_ftl_read(p->index * RKNAND_CACHE_PAGE_SECS,
+			      RKNAND_CACHE_PAGE_SECS, c->rd_buf);
+	if (ret)
+		return ret;
+	for (s = 0; s < RKNAND_CACHE_PAGE_SECS; s++)
+		if (!(p->valid & (1 << s)))
+			memcpy(p->data + s * 512, c->rd_buf + s * 512, 512);
+	p->valid = 0xff;
+	return 0;
+}
+
+/*
+ * Read the @nsec uncached sectors at @lba. When the stream is sequential,
+ * the read is widened to whole pages plus the read-ahead window, and the
+ * pages past the end of the request are inserted into the cache.
+ */
+static int rknand_cache_read_miss(unsigned int lba, int nsec, u_char *buf,
+				  int readahead)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *p;
+	unsigned int start, end, limit, index;
+	int ret;
+
+	c->stats.read_miss_secs += nsec;
+
+	start = rounddown(lba, RKNAND_CACHE_PAGE_SECS);
+	end = roundup(lba + nsec, RKNAND_CACHE_PAGE_SECS);
+	if (readahead)
+		end += roundup(rknand_cache_ra_secs, RKNAND_CACHE_PAGE_SECS);
+	end = min(end, start + RKNAND_CACHE_RUN_SECS);
+	limit = rounddown(gpNandInfo->nandCapacity, RKNAND_CACHE_PAGE_SECS);
+	end = min(end, limit);
+	for (index = (lba + nsec) / RKNAND_CACHE_PAGE_SECS;
+	     index < end / RKNAND_CACHE_PAGE_SECS; index++) {
+		if (rknand_cache_find(index)) {
+			end = index * RKNAND_CACHE_PAGE_SECS;
+			break;
+		}
+	}
+
+	if (!readahead || end < lba + nsec)
+		return rknand_ftl_read(lba, nsec, buf);
+
+	ret = rknand_ftl_read(start, end - start, c->rd_buf);
+	if (ret)
+		return ret;
+	memcpy(buf, c->rd_buf + (lba - start) * 512, nsec * 512);
+
+	for (index = (lba + nsec) / RKNAND_CACHE_PAGE_SECS;
+	     index < end / RKNAND_CACHE_PAGE_SECS; index++) {
+		p = rknand_cache_get(index);
+		if (!p)
+			break;
+		memcpy(p->data, c->rd_buf + (index * RKNAND_CACHE_PAGE_SECS - start) * 512,
+		       RKNAND_CACHE_PAGE_SIZE);
+		p->valid = 0xff;
+		c->stats.ra_secs += RKNAND_CACHE_PAGE_SECS;
+	}
+	return 0;
+}
+
+static int rknand_cache_read(unsigned int lba, int nsec, u_char *buf)
+{
+	struct rknand_cache *c = &rknand_cache;
+	struct rknand_cache_page *p;
+	int readahead, ret = 0;
+
+	mutex_lock(&c->lock);
+	readahead = rknand_cache_ra_secs > 0 && lba == c->ra_next;
+	c->ra_next = lba + nsec;
+
+	while (nsec && !ret) {
+		int s = lba % RKNAND_CACHE_PAGE_SECS;
+		int n = min(nsec, RKNAND_CACHE_PAGE_SECS - s);
+		u8 mask = ((1 << n) - 1) << s;
+
+		p = rknand_cache_find(lba / RKNAND_CACHE_PAGE_SECS);
+		if (!p) {
+			/* gather the whole run of uncached pages */
+			unsigned int end = lba + n;
+
+			while (end < lba + nsec && end - lba < RKNAND_CACHE_RUN_SECS &&
+			       !rknand_cache_find(end / RKNAND_CACHE_PAGE_SECS))
+				end += min_t(unsigned int, lba + nsec - end,
+					     RKNAND_CACHE_PAGE_SECS);
+			n = end - lba;
+			ret = rknand_cache_read_miss(lba, n, buf, readahead);
+		} else {
+			if ((p->valid & mask) != mask)
+				ret = rknand_cache_fill(p);
+			if (!ret) {
+				memcpy(buf, p->data + s * 512, n * 512);
+				list_move(&p->lru, &c->lru);
+				c->stats.read_hit_secs += n;
+			}
+		}
+		lba += n;
+		buf += n * 512;
+		nsec -= n;
+	}
+	mutex_unlock(&c->lock);
+	return ret;
+}
+
+/*
+ * Called from the panic path, where the cache lock may be held by the
+ * context that crashed: only touch the cache if it can be taken.
+ */
+static void rknand_cache_panic_write(unsigned int lba, int nsec, const u_char *buf)
+{
+	if (!rknand_cache.enabled || !mutex_trylock(&rknand_cache.lock))
+		return;
+	rknand_cache_flush_locked(1);
+	rknand_cache_update(lba, nsec, buf);
+	mutex_unlock(&rknand_cache.lock);
+}
+
+static int rknand_cache_proc_read(char *page)
+{
+	struct rknand_cache_stats *st = &rknand_cache.stats;
+	char *buf = page;
+	unsigned long rd_kbs = 0, wr_kbs = 0;
+
+	if (!rknand_cache.enabled)
+		return sprintf(buf, "sector cache: off\n");
+
+	if (st->ftl_read_ns)
+		rd_kbs = div64_u64((u64)st->ftl_read_secs * 500000000ULL, st->ftl_read_ns);
+	if (st->ftl_write_ns)
+		wr_kbs = div64_u64((u64)st->ftl_write_secs * 500000000ULL, st->ftl_write_ns);
+
+	buf += sprintf(buf, "sector cache: %d pages, readahead %d, bypass %d\n",
+		       rknand_cache_pages, rknand_cache_ra_secs, rknand_cache_bypass_secs);
+	buf += sprintf(buf, "read: hit %lu miss %lu readahead %lu sectors\n",
+		       st->read_hit_secs, st->read_miss_secs, st->ra_secs);
+	buf += sprintf(buf, "write: cached %lu bypass %lu sectors\n",
+		       st->write_secs, st->write_bypass_secs);
+	buf += sprintf(buf, "writeback: %lu runs %lu sectors %lu errors %lu flushes\n",
+		       st->wb_runs, st->wb_secs, st->wb_errors, st->flushes);
+	buf += sprintf(buf, "ftl: read %lu sectors %lu KB/s, write %lu sectors %lu KB/s\n",
+		       st->ftl_read_secs, rd_kbs, st->ftl_write_secs, wr_kbs);
+	return buf - page;
+}
+
+static void rknand_cache_init(void)
+{
+	struct rknand_cache *c = &rknand_cache;
+	int i;
+
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->lru);
+	for (i = 0; i < RKNAND_CACHE_HASH; i++)
+		INIT_HLIST_HEAD(&c->hash[i]);
+
+	if (rknand_cache_pages <= 0)
+		return;
+	/* a read-ahead must never recycle the pages it is filling */
+	if (rknand_cache_pages < 2 * RKNAND_CACHE_RUN_SECS / RKNAND_CACHE_PAGE_SECS)
+		rknand_cache_pages = 2 * RKNAND_CACHE_RUN_SECS / RKNAND_CACHE_PAGE_SECS;
+
+	c->pages = kcalloc(rknand_cache_pages, sizeof(*c->pages), GFP_KERNEL);
+	c->data = vmalloc(rknand_cache_pages * RKNAND_CACHE_PAGE_SIZE);
+	c->wb_buf = kmalloc(RKNAND_CACHE_RUN_SECS * 512, GFP_KERNEL);
+	c->rd_buf = kmalloc(RKNAND_CACHE_RUN_SECS * 512, GFP_KERNEL);
+	if (!c->pages || !c->data || !c->wb_buf || !c->rd_buf) {
+		printk(KERN_WARNING "rknand: no memory for the sector cache, disabled\n");
+		kfree(c->pages);
+		vfree(c->data);
+		kfree(c->wb_buf);
+		kfree(c->rd_buf);
+		return;
+	}
+
+	for (i = 0; i < rknand_cache_pages; i++) {
+		struct rknand_cache_page *p = &c->pages[i];
+
+		p->index = RKNAND_CACHE_NO_INDEX;
+		p->data = c->data + i * RKNAND_CACHE_PAGE_SIZE;
+		list_add_tail(&p->lru, &c->lru);
+	}
+	c->ra_next = RKNAND_CACHE_NO_INDEX;
+	INIT_DELAYED_WORK(&c->flush_work, rknand_cache_flush_work);
+	c->enabled = 1;
+}
+
+static void rknand_cache_exit(void)
+{
+	if (!rknand_cache.enabled)
+		return;
+	cancel_delayed_work_sync(&rknand_cache.flush_work);
+	rknand_cache_flush();
+}
+
+static int rknand_sector_read(int LBA, int sector, void *buf)
+{
+	if (rknand_cache.enabled)
+		return rknand_cache_read(LBA, sector, buf);
+	return gpNandInfo->ftl_read(LBA, sector, buf);
+}
+
+static int rknand_sector_write(int LBA, int sector, const void *buf)
+{
+	if (rknand_cache.enabled)
+		return rknand_cache_write(LBA, sector, buf);
+	return gpNandInfo->ftl_write(LBA, sector, (void *)buf, LBA < SysImageWriteEndAdd);
+}
+#else
+static int rknand_sector_read(int LBA, int sector, void *buf)
+{
+	return gpNandInfo->ftl_read(LBA, sector, buf);
+}
+
+static int rknand_sector_write(int LBA, int sector, const void *buf)
+{
+	return gpNandInfo->ftl_write(LBA, sector, (void *)buf, LBA < SysImageWriteEndAdd);
+}
+
+static inline int rknand_cache_flush(void) { return 0; }
+static inline void rknand_cache_panic_write(unsigned int lba, int nsec, const u_char *buf) {}
+static inline void rknand_cache_init(void) {}
+static inline void rknand_cache_exit(void) {}
+#endif
+
 static struct proc_dir_entry *my_proc_entry;
 extern int rkNand_proc_ftlread(char *page);
 extern int rkNand_proc_bufread(char *page);
@@ -137,6 +696,9 @@ static int rkNand_proc_read(char *page,
             buf += gpNandInfo->proc_ftlread(buf);
         if(gpNandInfo->proc_bufread)
             buf += gpNandInfo->proc_bufread(buf);
+#ifdef CONFIG_MTD_RKNAND_SECTOR_CACHE
+        buf += rknand_cache_proc_read(buf);
+#endif
 #ifdef RKNAND_TRAC_EN
         buf += sprintf(buf, "trac data len:%d\n", ptrac_buf - grknand_trac_buf);
 #endif
@@ -195,7 +757,7 @@ static int rknand_read(struct mtd_info *mtd, loff_t from, size_t len,
 	*retlen = len;
     if(sector && gpNandInfo->ftl_read)
     {
-		ret = gpNandInfo->ftl_read(LBA, sector, buf);
+		ret = rknand_sector_read(LBA, sector, buf);
 		if(ret)
 		   *retlen = 0;
     }
@@ -219,18 +781,12 @@ static int rknand_write(struct mtd_info *mtd, loff_t from, size_t len,
     //printk_write_log(LBA,sector,buf);
 	if(sector && gpNandInfo->ftl_write)// cmy
 	{
-		if(LBA < SysImageWriteEndAdd)//0x4E000)
-		{
-			//NAND_DEBUG(NAND_DEBUG_LEVEL0,">>> FtlWriteImage: LBA=0x%08X  sector=%d\n",LBA, sector);
-            ret = gpNandInfo->ftl_write(LBA, sector, (void *)buf,1);
-        }
-		else
-        {
-            ret = gpNandInfo->ftl_write(LBA, sector, (void *)buf,0);
-        }
+		/* LBA < SysImageWriteEndAdd is written in image mode */
+		ret = rknand_sector_write(LBA, sector, buf);
 	}
-	*retlen = len;
-	return 0;
+	/* a failed write may have stopped part way, don't claim any of it */
+	*retlen = ret ? 0 : len;
+	return ret;
 }
 
 static int rknand_erase(struct mtd_info *mtd, struct erase_info *instr)
@@ -241,11 +797,21 @@ static int rknand_erase(struct mtd_info *mtd, struct erase_info *instr)
 	return ret;
 }
 
-static void rknand_sync(struct mtd_info *mtd)
+/* Write back the sector cache and the FTL's own; reports cache errors. */
+static int rknand_flush(struct mtd_info *mtd)
 {
+	int ret;
+
 	NAND_DEBUG(NAND_DEBUG_LEVEL0,"rk_nand_sync: \n");
-    if(gpNandInfo->ftl_sync)
-        gpNandInfo->ftl_sync();
+	ret = rknand_cache_flush();
+	if (gpNandInfo->ftl_sync)
+		gpNandInfo->ftl_sync();
+	return ret;
+}
+
+static void rknand_sync(struct mtd_info *mtd)
+{
+	rknand_flush(mtd);
 }
 
 extern void FtlWriteCacheEn(int);
@@ -257,6 +823,7 @@ static int rknand_panic_write(struct mtd_info *mtd, loff_t to, size_t len, size_
 	if (sector && gpNandInfo->ftl_write_panic) {
 	    if(gpNandInfo->ftl_cache_en)
 		    gpNandInfo->ftl_cache_en(0);
+		rknand_cache_panic_write(LBA, sector, buf);
 		gpNandInfo->ftl_write_panic(LBA, sector, (void *)buf);
 	    if(gpNandInfo->ftl_cache_en)
 		    gpNandInfo->ftl_cache_en(1);
@@ -319,7 +886,7 @@ int  GetParamterInfo(char * pbuf , int len)
 	int LBA = 0;
 	if(sector && gpNandInfo->ftl_read)
 	{
-		ret = gpNandInfo->ftl_read(LBA, sector, pbuf);
+		ret = rknand_sector_read(LBA, sector, pbuf);
 	}
 	return ret?-1:(sector<<9);
 }
@@ -331,7 +898,7 @@ int  GetflashDataByLba(int lba,char * pbuf , int len)
 	int LBA = lba;
 	if(sector && gpNandInfo->ftl_read)
 	{
-		ret = gpNandInfo->ftl_read(LBA, sector, pbuf);
+		ret = rknand_sector_read(LBA, sector, pbuf);
 	}
 	return ret?-1:(sector<<9);
 }
@@ -403,6 +970,7 @@ static int rknand_info_init(struct rknand_info *nand_info)
 	mtd->panic_write = rknand_panic_write;
 
 	mtd->sync = rknand_sync;
+	mtd->flush = rknand_flush;
 	mtd->lock = NULL;
 	mtd->unlock = NULL;
 	mtd->suspend = NULL;
@@ -527,6 +1095,7 @@ static int rknand_probe(struct platform_device *pdev)
 	nand_info->add_rknand_device = add_rknand_device;
 	nand_info->get_rknand_device = get_rknand_device;
 
+	rknand_cache_init();
 	rknand_create_procfs();
 	return 0;
 
@@ -539,6 +1108,7 @@ exit_free:
 
 static int rknand_suspend(struct platform_device *pdev, pm_message_t state)
 {
+    rknand_cache_flush();
     gpNandInfo->rknand.rknand_schedule_enable = 0;
     if(gpNandInfo->rknand_suspend)
         gpNandInfo->rknand_suspend();  
@@ -558,6 +1128,7 @@ static int rknand_resume(struct platform_device *pdev)
 void rknand_shutdown(struct platform_device *pdev)
 {
     printk("rknand_shutdown...\n");
+    rknand_cache_flush();
     gpNandInfo->rknand.rknand_schedule_enable = 0;
     if(gpNandInfo->rknand_buffer_shutdown)
         gpNandInfo->rknand_buffer_shutdown();    
@@ -588,6 +1159,7 @@ static int __init rknand_init(void)
 
 static void __exit rknand_exit(void)
 {
+    rknand_cache_exit();
     platform_driver_unregister(&rknand_driver);
 }
 
@@ -25,10 +25,42 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/*
+ * Size of each per-cpu staging buffer. Must hold at least one entry of
+ * LOGGER_ENTRY_MAX_PAYLOAD.
+ */
+#define LOGGER_STAGE_SIZE	(8 * 1024)
+
+/*
+ * struct logger_stage - per-cpu staging buffer of a log
+ *
+ * Writers append entries here, under the stage's own mutex only. Entries
+ * are moved to the log's ring buffer by merge_stages(). The mutex is per
+ * cpu, so it is only contended when a writer migrates or a merge runs.
+ */
+struct logger_stage {
+	struct mutex		mutex;	/* protects buffer and len */
+	unsigned char		*buffer;/* staged entries */
+	size_t			len;	/* bytes used in buffer */
+};
+
+/*
+ * struct logger_staged_entry - header of an entry in a staging buffer
+ *
+ * 'seq' is taken from the log-wide counter at write time. It orders the
+ * entries of all cpus the way their timestamps would, without ties.
+ */
+struct logger_staged_entry {
+	__u32			seq;
+	struct logger_entry	hdr;
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
@@ -45,6 +77,9 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_stage __percpu *stages; /* per-cpu write staging */
+	unsigned char		*merge_buf; /* scratch for merge_stages() */
+	atomic_t		seq;	/* sequence of staged entries */
 };
 
 /*
@@ -255,6 +290,7 @@ start:
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
+		merge_stages(log);
 		ret = (log->w_off == reader->r_off);
 		mutex_unlock(&log->mutex);
 		if (!ret)
@@ -410,20 +446,204 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * write_entry - appends a complete entry, header and payload, to the ring
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void write_entry(struct logger_log *log, struct logger_entry *hdr,
+			const void *msg)
+{
+	fix_up_readers(log, sizeof(struct logger_entry) + hdr->len);
+	do_write_log(log, hdr, sizeof(struct logger_entry));
+	do_write_log(log, msg, hdr->len);
+}
+
+static inline size_t staged_entry_len(struct logger_staged_entry *entry)
+{
+	return sizeof(struct logger_staged_entry) + entry->hdr.len;
+}
+
+/*
+ * take_stage - moves the entries of 'stage' with a sequence number up to
+ * 'seq' into 'dst', keeping the newer ones staged. Returns the number of
+ * bytes moved.
+ */
+static size_t take_stage(struct logger_stage *stage, unsigned char *dst,
+			 __u32 seq)
+{
+	struct logger_staged_entry entry;
+	size_t off = 0;
+
+	mutex_lock(&stage->mutex);
+	while (off < stage->len) {
+		memcpy(&entry, stage->buffer + off, sizeof(entry));
+		if ((__s32)(entry.seq - seq) > 0)
+			break;
+		off += staged_entry_len(&entry);
+	}
+
+	memcpy(dst, stage->buffer, off);
+	memmove(stage->buffer, stage->buffer + off, stage->len - off);
+	stage->len -= off;
+	mutex_unlock(&stage->mutex);
+
+	return off;
+}
+
+/*
+ * merge_stages - moves the entries staged on all cpus to the ring buffer,
+ * in the order they were written
+ *
+ * Only entries up to the current sequence number are merged: writers take
+ * their sequence number under the stage's mutex, so every one of them is
+ * complete once that mutex is taken, and anything written later goes after
+ * them. Every stage has to be locked, one at a time, even if it looks
+ * empty: a writer holding a number below 'seq' may not have published its
+ * entry yet.
+ *
+ * The caller needs to hold log->mutex.
+ */
+static void merge_stages(struct logger_log *log)
+{
+	size_t pos[NR_CPUS], end[NR_CPUS];
+	struct logger_staged_entry entry, next;
+	__u32 seq;
+	int cpu, first;
+
+	if (!log->stages)
+		return;
+
+	seq = atomic_read(&log->seq);
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stages, cpu);
+
+		pos[cpu] = cpu * LOGGER_STAGE_SIZE;
+		end[cpu] = pos[cpu] +
+			take_stage(stage, log->merge_buf + pos[cpu], seq);
+	}
+
+	for (;;) {
+		first = -1;
+		for_each_possible_cpu(cpu) {
+			if (pos[cpu] == end[cpu])
+				continue;
+			memcpy(&next, log->merge_buf + pos[cpu], sizeof(next));
+			if (first < 0 || (__s32)(next.seq - entry.seq) < 0) {
+				first = cpu;
+				entry = next;
+			}
+		}
+		if (first < 0)
+			break;
+
+		write_entry(log, &entry.hdr, log->merge_buf + pos[first] +
+			    sizeof(struct logger_staged_entry));
+		pos[first] += staged_entry_len(&entry);
+	}
+}
+
+/*
+ * stage_write - stages an entry in the current cpu's buffer
+ *
+ * Returns the payload length on success, negative error code on failure.
+ */
+static ssize_t stage_write(struct logger_log *log, struct kiocb *iocb,
+			   const struct iovec *iov, unsigned long nr_segs)
+{
+	struct logger_staged_entry entry;
+	struct logger_stage *stage;
+	struct timespec now;
+	unsigned char *p;
+	size_t len, need;
+	ssize_t ret = 0;
+
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	need = sizeof(struct logger_staged_entry) + len;
+
+	for (;;) {
+		stage = per_cpu_ptr(log->stages, get_cpu());
+		put_cpu();
+
+		mutex_lock(&stage->mutex);
+		if (stage->len + need <= LOGGER_STAGE_SIZE)
+			break;
+		mutex_unlock(&stage->mutex);
+
+		/* our stage is full, push everything to the ring */
+		mutex_lock(&log->mutex);
+		merge_stages(log);
+		mutex_unlock(&log->mutex);
+	}
+
+	now = current_kernel_time();
+
+	entry.seq = atomic_inc_return(&log->seq);
+	entry.hdr.pid = current->tgid;
+	entry.hdr.tid = current->pid;
+	entry.hdr.sec = now.tv_sec;
+	entry.hdr.nsec = now.tv_nsec;
+	entry.hdr.euid = current_euid();
+	entry.hdr.len = len;
+	entry.hdr.hdr_size = sizeof(struct logger_entry);
+
+	p = stage->buffer + stage->len;
+	memcpy(p, &entry, sizeof(entry));
+	p += sizeof(entry);
+
+	while (nr_segs-- > 0) {
+		size_t seg;
+
+		/* figure out how much of this vector we can keep */
+		seg = min_t(size_t, iov->iov_len, len - ret);
+
+		if (seg && copy_from_user(p, iov->iov_base, seg)) {
+			mutex_unlock(&stage->mutex);
+			return -EFAULT;
+		}
+
+		p += seg;
+		ret += seg;
+		iov++;
+	}
+
+	/* only now does the entry become visible to merge_stages() */
+	stage->len += need;
+	mutex_unlock(&stage->mutex);
+
+	return ret;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
- * them above all else.
+ * them above all else: entries are staged per cpu and only merged into the
+ * ring when a reader looks at the log or a staging buffer fills up.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
 
+	/* null writes succeed, return zero */
+	if (unlikely(!iocb->ki_left))
+		return 0;
+
+	if (likely(log->stages)) {
+		ret = stage_write(log, iocb, iov, nr_segs);
+		if (ret > 0) {
+			/* pairs with prepare_to_wait() in logger_read() */
+			smp_mb();
+			if (waitqueue_active(&log->wq))
+				wake_up_interruptible(&log->wq);
+		}
+		return ret;
+	}
+
 	now = current_kernel_time();
 
 	header.pid = current->tgid;
@@ -434,11 +654,8 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 	header.hdr_size = sizeof(struct logger_entry);
 
-	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
-		return 0;
-
 	mutex_lock(&log->mutex);
+	orig = log->w_off;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -568,6 +785,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
+	merge_stages(log);
 	if (!reader->r_all)
 		reader->r_off = get_next_entry_by_uid(log,
 			reader->r_off, current_euid());
@@ -600,6 +818,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	void __user *argp = (void __user *) arg;
 
 	mutex_lock(&log->mutex);
+	merge_stages(log);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -698,6 +917,7 @@ static struct logger_log VAR = { \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.seq = ATOMIC_INIT(0), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -718,10 +938,50 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/*
+ * init_stages - sets up per-cpu write staging for 'log'. On failure, the
+ * log is written directly under log->mutex instead.
+ */
+static void __init init_stages(struct logger_log *log)
+{
+	int cpu;
+
+	log->stages = alloc_percpu(struct logger_stage);
+	log->merge_buf = vmalloc(nr_cpu_ids * LOGGER_STAGE_SIZE);
+	if (!log->stages || !log->merge_buf)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct logger_stage *stage = per_cpu_ptr(log->stages, cpu);
+
+		mutex_init(&stage->mutex);
+		stage->len = 0;
+		stage->buffer = kmalloc(LOGGER_STAGE_SIZE, GFP_KERNEL);
+		if (!stage->buffer)
+			goto fail;
+	}
+
+	return;
+
+fail:
+	printk(KERN_WARNING "logger: no write staging for log '%s'\n",
+	       log->misc.name);
+	if (log->stages) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(log->stages, cpu)->buffer);
+		free_percpu(log->stages);
+		log->stages = NULL;
+	}
+	vfree(log->merge_buf);
+	log->merge_buf = NULL;
+}
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	init_stages(log);
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
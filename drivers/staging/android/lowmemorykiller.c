@@ -12,6 +12,14 @@
  * and kill processes with a oom_adj value of 0 or higher when the free memory
  * drops below 1024 pages.
  *
+ * Setting /sys/module/lowmemorykiller/parameters/pressure_mode makes kills
+ * also depend on reclaim efficiency, see the pressure comment below.
+ *
+ * Candidate processes are kept in an index bucketed by oom_adj, so a
+ * shrinker call only looks at the highest non-empty bucket above the
+ * current threshold. Scan time and kills per level are reported in
+ * /sys/kernel/debug/lowmemorykiller.
+ *
  * The driver considers memory used for caches to be free, but if a large
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
@@ -35,6 +43,20 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/vmstat.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -61,6 +83,299 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * Candidate index.
+ *
+ * Every process is kept on the list matching its oom_adj, so that the
+ * shrinker only has to look at the highest non-empty bucket instead of
+ * walking the whole task list. Entries are added or moved when a process
+ * is forked, when exec makes another thread its leader, or when its oom_adj
+ * is written, and dropped when the task is freed.
+ * They are also hashed by task so that they can be found on those events.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_TASK_HASH_BITS	8
+
+struct lowmem_task {
+	struct hlist_node task_node;
+	struct list_head adj_node;
+	struct task_struct *task;
+	int adj;
+};
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_adj_index[LOWMEM_ADJ_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_TASK_HASH_BITS];
+
+/* Statistics, see /sys/kernel/debug/lowmemorykiller */
+static unsigned long lowmem_scan_count;
+static u64 lowmem_scan_time_ns;
+static u64 lowmem_scan_time_max_ns;
+static unsigned long lowmem_kill_count[ARRAY_SIZE(lowmem_adj)];
+
+/*
+ * Memory pressure.
+ *
+ * Pressure is the share of pages scanned by vmscan that could not be
+ * reclaimed, sampled from the shrinker calls over windows of
+ * lowmem_pressure_window scanned pages and averaged. It is mapped to a
+ * level with hysteresis; level changes can be polled on /dev/lowmem_pressure
+ * so that userspace can trim its caches before anything gets killed.
+ *
+ * With pressure_mode set, the level also gates kills: at low pressure only
+ * the first minfree threshold kills, at critical pressure the most
+ * expendable adj level is killed even above the minfree thresholds.
+ */
+enum lowmem_pressure_level {
+	LOWMEM_PRESSURE_LOW,
+	LOWMEM_PRESSURE_MEDIUM,
+	LOWMEM_PRESSURE_CRITICAL,
+	LOWMEM_PRESSURE_NR_LEVELS,
+};
+
+static const char * const lowmem_pressure_names[] = {
+	"low",
+	"medium",
+	"critical",
+};
+
+static int lowmem_pressure_mode;
+static int lowmem_pressure_medium = 60;
+static int lowmem_pressure_critical = 90;
+static int lowmem_pressure_hysteresis = 10;
+static unsigned int lowmem_pressure_window = 1024;
+
+static int lowmem_pressure;
+static int lowmem_pressure_level;
+static unsigned long lowmem_pressure_seq;
+static unsigned long lowmem_last_scanned;
+static unsigned long lowmem_last_reclaimed;
+static DEFINE_MUTEX(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
+static void lowmem_pressure_decay(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_decay);
+
+/* Called with lowmem_pressure_lock held, which protects the buffer */
+static void lowmem_reclaim_events(unsigned long *scanned,
+				  unsigned long *reclaimed)
+{
+#ifdef CONFIG_VM_EVENT_COUNTERS
+	static unsigned long events[NR_VM_EVENT_ITEMS];
+	int zone;
+
+	all_vm_events(events);
+	*scanned = 0;
+	*reclaimed = 0;
+	for (zone = 0; zone < MAX_NR_ZONES; zone++) {
+		*scanned += events[PGSCAN_KSWAPD_NORMAL - ZONE_NORMAL + zone];
+		*scanned += events[PGSCAN_DIRECT_NORMAL - ZONE_NORMAL + zone];
+		*reclaimed += events[PGSTEAL_NORMAL - ZONE_NORMAL + zone];
+	}
+#else
+	*scanned = 0;
+	*reclaimed = 0;
+#endif
+}
+
+static int lowmem_pressure_threshold(int level)
+{
+	switch (level) {
+	case LOWMEM_PRESSURE_CRITICAL:
+		return lowmem_pressure_critical;
+	case LOWMEM_PRESSURE_MEDIUM:
+		return lowmem_pressure_medium;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Take a new pressure sample once enough pages have been scanned, or
+ * unconditionally with @force when reclaim has gone quiet.
+ */
+static void lowmem_update_pressure(bool force)
+{
+	unsigned long scanned, reclaimed, delta_scanned, delta_reclaimed;
+	int sample, level, old_level;
+
+	/* Concurrent shrinkers see the same counters; one sample is enough */
+	if (!mutex_trylock(&lowmem_pressure_lock))
+		return;
+
+	lowmem_reclaim_events(&scanned, &reclaimed);
+	delta_scanned = scanned - lowmem_last_scanned;
+	if (delta_scanned < lowmem_pressure_window && !force)
+		goto out;
+
+	delta_reclaimed = min(reclaimed - lowmem_last_reclaimed, delta_scanned);
+	lowmem_last_scanned = scanned;
+	lowmem_last_reclaimed = reclaimed;
+
+	sample = 0;
+	if (delta_scanned)
+		sample = 100 - delta_reclaimed * 100 / delta_scanned;
+	lowmem_pressure = (lowmem_pressure + sample) / 2;
+
+	if (lowmem_pressure >= lowmem_pressure_critical)
+		level = LOWMEM_PRESSURE_CRITICAL;
+	else if (lowmem_pressure >= lowmem_pressure_medium)
+		level = LOWMEM_PRESSURE_MEDIUM;
+	else
+		level = LOWMEM_PRESSURE_LOW;
+
+	/* Only leave a level once pressure is well below its threshold */
+	old_level = lowmem_pressure_level;
+	for (; old_level > level; old_level--) {
+		if (lowmem_pressure >= lowmem_pressure_threshold(old_level) -
+				lowmem_pressure_hysteresis) {
+			level = old_level;
+			break;
+		}
+	}
+
+	if (level != lowmem_pressure_level) {
+		lowmem_print(3, "pressure %d, level %s -> %s\n",
+			     lowmem_pressure,
+			     lowmem_pressure_names[lowmem_pressure_level],
+			     lowmem_pressure_names[level]);
+		lowmem_pressure_level = level;
+		lowmem_pressure_seq++;
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+
+	/* The shrinker is not called once reclaim stops; decay from here */
+	if (lowmem_pressure_level != LOWMEM_PRESSURE_LOW)
+		schedule_delayed_work(&lowmem_pressure_work, HZ);
+out:
+	mutex_unlock(&lowmem_pressure_lock);
+}
+
+static void lowmem_pressure_decay(struct work_struct *work)
+{
+	lowmem_update_pressure(true);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	char buffer[32];
+	loff_t pos = 0;
+	int len;
+
+	/* Every read returns the current state, no need to seek back */
+	file->private_data = (void *)ACCESS_ONCE(lowmem_pressure_seq);
+	len = snprintf(buffer, sizeof(buffer), "%s %d\n",
+		       lowmem_pressure_names[lowmem_pressure_level],
+		       lowmem_pressure);
+
+	return simple_read_from_buffer(buf, count, &pos, buffer, len);
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	if ((unsigned long)file->private_data != lowmem_pressure_seq)
+		return POLLIN | POLLRDNORM | POLLPRI;
+
+	return 0;
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)ACCESS_ONCE(lowmem_pressure_seq);
+
+	return nonseekable_open(inode, file);
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lowmem_pressure_open,
+	.read		= lowmem_pressure_read,
+	.poll		= lowmem_pressure_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "lowmem_pressure",
+	.fops		= &lowmem_pressure_fops,
+};
+
+static struct list_head *lowmem_adj_bucket(int adj)
+{
+	adj = clamp(adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_adj_index[adj - OOM_DISABLE];
+}
+
+static struct hlist_head *lowmem_task_bucket(struct task_struct *task)
+{
+	return &lowmem_task_hash[hash_ptr(task, LOWMEM_TASK_HASH_BITS)];
+}
+
+/* Called with lowmem_index_lock held */
+static struct lowmem_task *lowmem_task_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry(lt, pos, lowmem_task_bucket(task), task_node) {
+		if (lt->task == task)
+			return lt;
+	}
+
+	return NULL;
+}
+
+static void lowmem_index_task(struct task_struct *task, gfp_t gfp_mask)
+{
+	struct lowmem_task *lt, *new;
+	unsigned long flags;
+	int adj = ACCESS_ONCE(task->signal->oom_adj);
+
+	new = kmalloc(sizeof(*new), gfp_mask);
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_task_find(task);
+	if (lt) {
+		if (lt->adj != adj) {
+			lt->adj = adj;
+			list_move_tail(&lt->adj_node,
+				       lowmem_adj_bucket(adj));
+		}
+	} else if (new) {
+		new->task = task;
+		new->adj = adj;
+		hlist_add_head(&new->task_node, lowmem_task_bucket(task));
+		list_add_tail(&new->adj_node, lowmem_adj_bucket(adj));
+		new = NULL;
+	} else {
+		lowmem_print(1, "failed to index %d (%s), adj %d\n",
+			     task->pid, task->comm, adj);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	kfree(new);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data);
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	lowmem_index_task(data, GFP_KERNEL);
+
+	return NOTIFY_OK;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -72,20 +387,113 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct lowmem_task *lt;
+	unsigned long flags;
 
 	if (task == lowmem_deathpending)
 		lowmem_deathpending = NULL;
 
+	/* May run from an RCU callback, hence the irqsave */
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_task_find(task);
+	if (lt) {
+		hlist_del(&lt->task_node);
+		list_del(&lt->adj_node);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	kfree(lt);
+
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * Take a reference on up to @max tasks of bucket @adj, starting after the
+ * first *@pos entries; *@pos is advanced past the entries looked at. Only
+ * the index lock is held here: task_lock and the RSS walk must not nest
+ * inside it, as task_notify_func() takes it from softirq context.
+ *
+ * An entry is only unhooked from __put_task_struct(), after the last
+ * reference is gone, so a task found here may already be on its way to
+ * being freed. The index lock keeps its memory around; take a reference
+ * only if it still has one.
+ */
+static int lowmem_grab_tasks(int adj, int *pos, struct task_struct **tasks,
+			     int max)
 {
-	struct task_struct *p;
+	struct lowmem_task *lt;
+	unsigned long flags;
+	int skip = *pos;
+	int walked = 0, n = 0;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_for_each_entry(lt, lowmem_adj_bucket(adj), adj_node) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (atomic_inc_not_zero(&lt->task->usage))
+			tasks[n++] = lt->task;
+		if (++walked == max)
+			break;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	*pos += walked;
+	return n;
+}
+
+#define LOWMEM_SELECT_BATCH	16
+
+/*
+ * Pick the largest task from the highest oom_adj bucket at or above
+ * min_adj. Returns it with a reference held.
+ */
+static struct task_struct *lowmem_select(int min_adj, int *selected_tasksize,
+					 int *selected_oom_adj)
+{
+	struct task_struct *tasks[LOWMEM_SELECT_BATCH];
 	struct task_struct *selected = NULL;
+	int adj, pos, last, n, i;
+
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		pos = 0;
+		do {
+			last = pos;
+			n = lowmem_grab_tasks(adj, &pos, tasks,
+					      LOWMEM_SELECT_BATCH);
+			for (i = 0; i < n; i++) {
+				struct task_struct *p = tasks[i];
+				int tasksize = 0;
+
+				task_lock(p);
+				if (p->mm)
+					tasksize = get_mm_rss(p->mm);
+				task_unlock(p);
+				if (tasksize <= *selected_tasksize) {
+					put_task_struct(p);
+					continue;
+				}
+				if (selected)
+					put_task_struct(selected);
+				selected = p;
+				*selected_tasksize = tasksize;
+				*selected_oom_adj = adj;
+				lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+					     p->pid, p->comm, adj, tasksize);
+			}
+		} while (pos - last == LOWMEM_SELECT_BATCH);
+	}
+
+	return selected;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
 	int rem = 0;
-	int tasksize;
 	int i;
+	int level = -1;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
@@ -93,6 +501,8 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
+	ktime_t start;
+	u64 delta;
 
 	/*
 	 * If we already have a death outstanding, then
@@ -113,6 +523,27 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
 			min_adj = lowmem_adj[i];
+			level = i;
+			break;
+		}
+	}
+
+	lowmem_update_pressure(false);
+	if (lowmem_pressure_mode && array_size > 0) {
+		switch (lowmem_pressure_level) {
+		case LOWMEM_PRESSURE_LOW:
+			/* Reclaim keeps up, only the last-resort level kills */
+			if (level > 0) {
+				min_adj = OOM_ADJUST_MAX + 1;
+				level = -1;
+			}
+			break;
+		case LOWMEM_PRESSURE_CRITICAL:
+			/* Thrashing, even if the free counts look fine */
+			if (level < 0) {
+				level = array_size - 1;
+				min_adj = lowmem_adj[level];
+			}
 			break;
 		}
 	}
@@ -131,41 +562,16 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
+	start = ktime_get();
+	selected = lowmem_select(max(min_adj, OOM_DISABLE),
+				 &selected_tasksize, &selected_oom_adj);
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	lowmem_scan_count++;
+	lowmem_scan_time_ns += delta;
+	if (delta > lowmem_scan_time_max_ns)
+		lowmem_scan_time_max_ns = delta;
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -173,14 +579,46 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
+		put_task_struct(selected);
 		rem -= selected_tasksize;
+		lowmem_kill_count[level]++;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	seq_printf(m, "scans: %lu\n", lowmem_scan_count);
+	seq_printf(m, "scan_time_ns: %llu\n", lowmem_scan_time_ns);
+	seq_printf(m, "scan_time_max_ns: %llu\n", lowmem_scan_time_max_ns);
+	seq_printf(m, "pressure: %d\n", lowmem_pressure);
+	seq_printf(m, "pressure_level: %s\n",
+		   lowmem_pressure_names[lowmem_pressure_level]);
+	for (i = 0; i < lowmem_adj_size && i < ARRAY_SIZE(lowmem_adj); i++)
+		seq_printf(m, "kills[adj %d]: %lu\n",
+			   lowmem_adj[i], lowmem_kill_count[i]);
+
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, NULL);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.open		= lowmem_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static struct dentry *lowmem_debugfs;
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -188,15 +626,52 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_index[i]);
+
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	/* Index the processes that already exist */
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		if (p->mm)
+			lowmem_index_task(p, GFP_ATOMIC);
+	}
+	read_unlock(&tasklist_lock);
+
+	mutex_lock(&lowmem_pressure_lock);
+	lowmem_reclaim_events(&lowmem_last_scanned, &lowmem_last_reclaimed);
+	mutex_unlock(&lowmem_pressure_lock);
+	if (misc_register(&lowmem_pressure_dev))
+		lowmem_print(1, "failed to register pressure device\n");
+
 	register_shrinker(&lowmem_shrinker);
+	lowmem_debugfs = debugfs_create_file("lowmemorykiller", S_IRUGO, NULL,
+					     NULL, &lowmem_stats_fops);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *lt, *tmp;
+	int i;
+
+	debugfs_remove(lowmem_debugfs);
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	misc_deregister(&lowmem_pressure_dev);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 	task_free_unregister(&task_nb);
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++) {
+		list_for_each_entry_safe(lt, tmp, &lowmem_adj_index[i],
+					 adj_node)
+			kfree(lt);
+	}
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -204,6 +679,17 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 			 S_IRUGO | S_IWUSR);
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
+module_param_named(pressure_mode, lowmem_pressure_mode, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_medium, lowmem_pressure_medium, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_critical, lowmem_pressure_critical, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_hysteresis, lowmem_pressure_hysteresis, int,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure_window, lowmem_pressure_window, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure, int, S_IRUGO);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
@@ -23,15 +23,20 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/crypto.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 
 #include "zram_drv.h"
 
@@ -133,10 +138,219 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+static u64 zram_time_ns(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/*
+ * Compression streams are handed out from a per-device pool holding one
+ * stream per online CPU, so that pages can be compressed in parallel.
+ * A stream is kept across xv_malloc(), which may sleep, so we cannot
+ * simply use per-cpu data with preemption disabled. The crypto
+ * compressors keep state in their tfm, so reads need a stream too.
+ */
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	for (;;) {
+		spin_lock(&zram->stream_lock);
+		if (!list_empty(&zram->idle_streams)) {
+			zstrm = list_first_entry(&zram->idle_streams,
+					struct zram_stream, list);
+			list_del(&zstrm->list);
+			spin_unlock(&zram->stream_lock);
+			return zstrm;
+		}
+		spin_unlock(&zram->stream_lock);
+
+		zram_stat64_inc(zram, &zram->stats.stream_waits);
+		wait_event(zram->stream_wait,
+				!list_empty(&zram->idle_streams));
+	}
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->idle_streams);
+	spin_unlock(&zram->stream_lock);
+
+	wake_up(&zram->stream_wait);
+}
+
+static void zram_stream_free(struct zram_stream *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zram_stream *zram_stream_alloc(const char *compressor)
+{
+	struct zram_stream *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(compressor, 0, 0);
+	/*
+	 * Allocate 2 pages. 1 for compressed data, plus 1 extra for the
+	 * case when compressed size is larger than the original one.
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zram_stream_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+static void zram_destroy_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	while (!list_empty(&zram->idle_streams)) {
+		zstrm = list_first_entry(&zram->idle_streams,
+				struct zram_stream, list);
+		list_del(&zstrm->list);
+		zram_stream_free(zstrm);
+	}
+	zram->num_streams = 0;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	int i;
+	struct zram_stream *zstrm;
+
+	for (i = 0; i < num_online_cpus(); i++) {
+		zstrm = zram_stream_alloc(zram->compressor);
+		if (!zstrm)
+			return -ENOMEM;
+
+		list_add(&zstrm->list, &zram->idle_streams);
+		zram->num_streams++;
+	}
+
+	return 0;
+}
+
+/*
+ * Same-page deduplication.
+ *
+ * Every compressed object of a device with dedup enabled is described by
+ * a zram_dedup_entry, hashed on the checksum of its compressed data.
+ * Compression is deterministic, so identical pages produce identical
+ * objects and can share a single xvmalloc allocation. All table[] slots
+ * referring to a shared object point to the same <page, offset>; the
+ * entry holds the reference count. Protected by zram->lock.
+ */
+static u32 zram_dedup_checksum(const unsigned char *cmem, size_t clen)
+{
+	return jhash(cmem, clen, 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[checksum & (zram->dedup_buckets - 1)];
+}
+
+static struct zram_dedup_entry *zram_dedup_find(struct zram *zram,
+			const unsigned char *src, size_t clen, u32 checksum)
+{
+	int match;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		if (entry->checksum != checksum || entry->clen != clen)
+			continue;
+
+		cmem = kmap_atomic(entry->page, KM_USER1) + entry->offset +
+				sizeof(struct zobj_header);
+		match = !memcmp(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+
+		if (match)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static struct zram_dedup_entry *zram_dedup_lookup_obj(struct zram *zram,
+			struct page *page, u32 offset, size_t clen)
+{
+	u32 checksum;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct zram_dedup_entry *entry;
+
+	cmem = kmap_atomic(page, KM_USER0) + offset;
+	checksum = zram_dedup_checksum(cmem + sizeof(struct zobj_header),
+					clen);
+	kunmap_atomic(cmem, KM_USER0);
+
+	hlist_for_each_entry(entry, pos, zram_dedup_bucket(zram, checksum),
+				node) {
+		if (entry->page == page && entry->offset == offset)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void zram_dedup_destroy(struct zram *zram)
+{
+	size_t i;
+	struct zram_dedup_entry *entry;
+
+	if (!zram->dedup_table)
+		return;
+
+	for (i = 0; i < zram->dedup_buckets; i++) {
+		while (!hlist_empty(&zram->dedup_table[i])) {
+			entry = hlist_entry(zram->dedup_table[i].first,
+					struct zram_dedup_entry, node);
+			/* the objects went with the table slots */
+			WARN_ON_ONCE(entry->refcount);
+			hlist_del(&entry->node);
+			kfree(entry);
+		}
+	}
+
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+	zram->dedup_buckets = 0;
+}
+
+static int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	zram->dedup_buckets = roundup_pow_of_two(
+				max_t(size_t, num_pages / 16, 256));
+	zram->dedup_table = vzalloc(zram->dedup_buckets *
+				sizeof(*zram->dedup_table));
+	if (!zram->dedup_table) {
+		zram->dedup_buckets = 0;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/* Called with zram->lock held */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
 	void *obj;
+	struct zram_dedup_entry *entry;
 
 	struct page *page = zram->table[index].page;
 	u32 offset = zram->table[index].offset;
@@ -165,6 +379,20 @@ static void zram_free_page(struct zram *zram, size_t index)
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
 	kunmap_atomic(obj, KM_USER0);
 
+	if (zram->dedup_table) {
+		entry = zram_dedup_lookup_obj(zram, page, offset, clen);
+		if (likely(entry) && --entry->refcount) {
+			/* Object is still used by other slots */
+			zram_stat_dec(&zram->stats.pages_dup);
+			zram_stat_dec(&zram->stats.pages_stored);
+			goto clear;
+		}
+		if (likely(entry)) {
+			hlist_del(&entry->node);
+			kfree(entry);
+		}
+	}
+
 	xv_free(zram->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
@@ -173,6 +401,7 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
+clear:
 	zram->table[index].page = NULL;
 	zram->table[index].offset = 0;
 }
@@ -216,9 +445,11 @@ static void zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
+		ktime_t start;
+		unsigned int clen;
 		struct page *page;
 		struct zobj_header *zheader;
+		struct zram_stream *zstrm;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
@@ -245,28 +476,36 @@ static void zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+		zstrm = zram_stream_get(zram);
+
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
 		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
 				zram->table[index].offset;
 
-		ret = lzo1x_decompress_safe(
+		start = ktime_get();
+		ret = crypto_comp_decompress(zstrm->tfm,
 			cmem + sizeof(*zheader),
 			xv_get_object_size(cmem) - sizeof(*zheader),
 			user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 		kunmap_atomic(cmem, KM_USER1);
+		zram_stream_put(zram, zstrm);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret || clen != PAGE_SIZE)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
 
+		zram_stat64_add(zram, &zram->stats.decompr_time,
+				zram_time_ns(start));
+		zram_stat64_inc(zram, &zram->stats.num_decompr);
+
 		flush_dcache_page(page);
 		index++;
 	}
@@ -279,6 +518,37 @@ out:
 	bio_io_error(bio);
 }
 
+/*
+ * Look for an already stored object identical to the one just compressed
+ * into @src and, if found, make slot @index share it.
+ */
+static int zram_write_dedup(struct zram *zram, u32 index,
+			const unsigned char *src, size_t clen, u32 checksum)
+{
+	struct zram_dedup_entry *entry;
+
+	spin_lock(&zram->lock);
+	entry = zram_dedup_find(zram, src, clen, checksum);
+	if (!entry) {
+		spin_unlock(&zram->lock);
+		return 0;
+	}
+
+	entry->refcount++;
+	if (zram->table[index].page ||
+			zram_test_flag(zram, index, ZRAM_ZERO))
+		zram_free_page(zram, index);
+
+	zram->table[index].page = entry->page;
+	zram->table[index].offset = entry->offset;
+
+	zram_stat_inc(&zram->stats.pages_dup);
+	zram_stat_inc(&zram->stats.pages_stored);
+	spin_unlock(&zram->lock);
+
+	return 1;
+}
+
 static void zram_write(struct zram *zram, struct bio *bio)
 {
 	int i;
@@ -291,56 +561,71 @@ static void zram_write(struct zram *zram, struct bio *bio)
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
 		u32 offset;
-		size_t clen;
+		u32 checksum = 0;
+		ktime_t start;
+		unsigned int clen;
 		struct zobj_header *zheader;
+		struct zram_stream *zstrm;
+		struct zram_dedup_entry *entry = NULL;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			spin_lock(&zram->lock);
+			if (zram->table[index].page ||
+					zram_test_flag(zram, index, ZRAM_ZERO))
+				zram_free_page(zram, index);
+
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			spin_unlock(&zram->lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		/* Compression runs in parallel, on a stream of our own */
+		zstrm = zram_stream_get(zram);
+		src = zstrm->buffer;
+		clen = 2 * PAGE_SIZE;
+
+		start = ktime_get();
+		ret = crypto_comp_compress(zstrm->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_stream_put(zram, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
+		zram_stat64_add(zram, &zram->stats.compr_time,
+				zram_time_ns(start));
+		zram_stat64_inc(zram, &zram->stats.num_compr);
+
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			zram_stream_put(zram, zstrm);
+			zstrm = NULL;
+
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -349,32 +634,40 @@ static void zram_write(struct zram *zram, struct bio *bio)
 			}
 
 			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
 			goto memstore;
 		}
 
+		if (zram->dedup_table) {
+			checksum = zram_dedup_checksum(src, clen);
+			if (zram_write_dedup(zram, index, src, clen,
+						checksum)) {
+				zram_stream_put(zram, zstrm);
+				index++;
+				continue;
+			}
+
+			/* Failing this only costs us the dedup opportunity */
+			entry = kmalloc(sizeof(*entry), GFP_NOIO);
+		}
+
 		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
+				&page_store, &offset,
 				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+			zram_stream_put(zram, zstrm);
+			kfree(entry);
 			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
+				"page: %u, size=%u\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
 memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = kmap_atomic(page_store, KM_USER1) + offset;
 
 #if 0
 		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		if (clen != PAGE_SIZE) {
 			zheader = (struct zobj_header *)cmem;
 			zheader->table_idx = index;
 			cmem += sizeof(*zheader);
@@ -384,16 +677,45 @@ memstore:
 		memcpy(cmem, src, clen);
 
 		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		if (zstrm)
+			zram_stream_put(zram, zstrm);
+		else
 			kunmap_atomic(src, KM_USER0);
 
+		/*
+		 * Only the table update is serialized. The old object, if
+		 * any, is released here so that a concurrent overwrite of
+		 * the same sector cannot leak it.
+		 */
+		spin_lock(&zram->lock);
+		if (zram->table[index].page ||
+				zram_test_flag(zram, index, ZRAM_ZERO))
+			zram_free_page(zram, index);
+
+		zram->table[index].page = page_store;
+		zram->table[index].offset = offset;
+		if (unlikely(clen == PAGE_SIZE)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		}
+
+		if (entry) {
+			entry->checksum = checksum;
+			entry->refcount = 1;
+			entry->page = page_store;
+			entry->offset = offset;
+			entry->clen = clen;
+			hlist_add_head(&entry->node,
+				zram_dedup_bucket(zram, checksum));
+		}
+
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		spin_unlock(&zram->lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -461,29 +783,21 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	zram_destroy_streams(zram);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+	/*
+	 * Free all pages that are still in this zram device. With dedup,
+	 * zram_free_page() drops the slot's reference on a shared object
+	 * and frees objects that never got a dedup entry.
+	 */
+	for (index = 0; zram->table &&
+			index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (zram->table[index].page)
+			zram_free_page(zram, index);
 	}
 
+	zram_dedup_destroy(zram);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
@@ -511,17 +825,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -535,6 +841,14 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	if (zram->dedup) {
+		ret = zram_dedup_init(zram, num_pages);
+		if (ret) {
+			pr_err("Error allocating dedup hash table\n");
+			goto fail;
+		}
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
@@ -566,7 +880,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	spin_lock(&zram->lock);
 	zram_free_page(zram, index);
+	spin_unlock(&zram->lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,9 +895,14 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
+	spin_lock_init(&zram->lock);
 	mutex_init(&zram->init_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->stream_lock);
+	INIT_LIST_HEAD(&zram->idle_streams);
+	init_waitqueue_head(&zram->stream_wait);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -17,6 +17,9 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/wait.h>
 
 #include "xvmalloc.h"
 
@@ -40,6 +43,9 @@ struct zobj_header {
 
 /*-- Configurable parameters */
 
+/* Default compressor, see comp_algorithm in sysfs */
+static const char default_compressor[] = "lzo";
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -84,6 +90,19 @@ struct table {
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Describes a compressed object that may be shared by several
+ * table entries when deduplication is enabled.
+ */
+struct zram_dedup_entry {
+	struct hlist_node node;
+	u32 checksum;		/* jhash of compressed data */
+	u32 refcount;		/* no. of table entries using this object */
+	struct page *page;
+	u16 offset;
+	u16 clen;
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -92,20 +111,38 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 stream_waits;	/* I/Os that waited for a free stream */
+	u64 num_compr;		/* no. of pages compressed */
+	u64 compr_time;		/* total time spent compressing (ns) */
+	u64 num_decompr;	/* no. of pages decompressed */
+	u64 decompr_time;	/* total time spent decompressing (ns) */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
+	u32 pages_dup;		/* no. of pages sharing another's object */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 };
 
+/* Compressor transform and output buffer for one reader or writer */
+struct zram_stream {
+	struct crypto_comp *tfm;
+	void *buffer;
+	struct list_head list;
+};
+
 struct zram {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	spinlock_t lock;	/* protect table[] updates and the u32 stats */
+	spinlock_t stream_lock;	/* protect idle_streams */
+	struct list_head idle_streams;
+	wait_queue_head_t stream_wait;
+	int num_streams;
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	int dedup;		/* deduplicate identical objects */
+	struct hlist_head *dedup_table;
+	size_t dedup_buckets;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -283,7 +283,9 @@
 #include <linux/fs.h>
 #include <linux/kref.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/limits.h>
+#include <linux/math64.h>
 #include <linux/rwsem.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
@@ -320,10 +322,47 @@ static const char fsg_string_interface[] = "Mass Storage";
 #define FSG_NO_DEVICE_STRINGS    1
 #define FSG_NO_OTG               1
 #define FSG_NO_INTR_EP           1
+#define FSG_LUN_XFER_STATS       1
+#define FSG_LUN_WRITE_BEHIND     1
 
 #include "storage_common.c"
 
 
+/*
+ * Buffer ring.  storage_common.c sizes it for file_storage.c, where two
+ * 16 KB buffers leave a single USB transfer in flight while the other
+ * buffer is filled from or drained to the backing file.  Here the depth
+ * and size are parameters, applied when the function is set up.  If the
+ * larger buffers can't be allocated we fall back to FSG_BUFLEN.
+ */
+#define FSG_MAX_NUM_BUFFERS	32
+#define FSG_MAX_BUFLEN		(256 * 1024)
+
+static unsigned int fsg_num_buffers = 4;
+module_param(fsg_num_buffers, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fsg_num_buffers, "number of data buffers, applied on bind");
+
+static unsigned int fsg_buflen = 65536;
+module_param(fsg_buflen, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fsg_buflen, "size of each data buffer, applied on bind");
+
+/* read-ahead window on the backing file, 0 = leave the file's default */
+static unsigned int fsg_readahead_kb = 512;
+module_param(fsg_readahead_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fsg_readahead_kb, "read-ahead on the backing files in KB");
+
+/*
+ * Number of buffers at the tail of a WRITE that may still be waiting for
+ * vfs_write when the status is sent.  They are written out while the
+ * host moves on to the next command; a failure is reported as a unit
+ * attention on the next command.  Limited to fsg_num_buffers - 2 so that
+ * the CSW and the next CBW always find an empty buffer.
+ */
+static unsigned int fsg_write_behind = 2;
+module_param(fsg_write_behind, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(fsg_write_behind, "buffers that may be written after the status, 0 = off");
+
+
 /*-------------------------------------------------------------------------*/
 
 struct fsg_dev;
@@ -374,7 +413,19 @@ struct fsg_common {
 
 	struct fsg_buffhd	*next_buffhd_to_fill;
 	struct fsg_buffhd	*next_buffhd_to_drain;
-	struct fsg_buffhd	buffhds[FSG_NUM_BUFFERS];
+	struct fsg_buffhd	*buffhds;
+	unsigned int		fsg_num_buffers;
+	u32			buflen;
+
+	/*
+	 * Write-behind: the wb_pending buffers starting at
+	 * next_buffhd_to_drain hold data for wb_lun at wb_offset that has
+	 * been acknowledged to the host but not yet written.
+	 */
+	unsigned int		wb_max;
+	unsigned int		wb_pending;
+	struct fsg_lun		*wb_lun;
+	loff_t			wb_offset;
 
 	int			cmnd_size;
 	u8			cmnd[MAX_COMMAND_SIZE];
@@ -401,6 +452,7 @@ struct fsg_common {
 	unsigned int		short_packet_received:1;
 	unsigned int		bad_lun_okay:1;
 	unsigned int		running:1;
+	unsigned int		wb_this_cmnd:1;
 
 	int			thread_wakeup_needed;
 	struct completion	thread_notifier;
@@ -747,6 +799,32 @@ static int sleep_thread(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+/*
+ * kever@rk
+ * max size for dwc_otg ctonroller is 64(max pkt sizt) * 1023(pkt)
+ * because of the DOEPTSIZ.PKTCNT has only 10 bits
+ */
+static u32 fsg_xfer_len(struct fsg_common *common)
+{
+	if (common->gadget->speed != USB_SPEED_HIGH)
+		return min(common->buflen, (u32)0x8000);
+	return common->buflen;
+}
+
+/* Open up the backing file's read-ahead window for streaming READs */
+static void fsg_lun_readahead(struct fsg_lun *curlun)
+{
+	struct file	*filp = curlun->filp;
+	unsigned int	ra_pages = fsg_readahead_kb >> (PAGE_CACHE_SHIFT - 10);
+
+	if (!ra_pages || filp->f_ra.ra_pages == ra_pages)
+		return;
+	spin_lock(&filp->f_lock);
+	filp->f_ra.ra_pages = ra_pages;
+	filp->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&filp->f_lock);
+}
+
 static int do_read(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
@@ -758,6 +836,7 @@ static int do_read(struct fsg_common *common)
 	unsigned int		amount;
 	unsigned int		partial_page;
 	ssize_t			nread;
+	ktime_t			start;
 
 	/*
 	 * Get the starting Logical Block Address and check that it's
@@ -788,6 +867,7 @@ static int do_read(struct fsg_common *common)
 	amount_left = common->data_size_from_cmnd;
 	if (unlikely(amount_left == 0))
 		return -EIO;		/* No default reply */
+	fsg_lun_readahead(curlun);
 
 	for (;;) {
 		/*
@@ -800,7 +880,7 @@ static int do_read(struct fsg_common *common)
 		 * If this means reading 0 then we were asked to read past
 		 *	the end of file.
 		 */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, fsg_xfer_len(common));
 		amount = min((loff_t)amount,
 			     curlun->file_length - file_offset);
 		partial_page = file_offset & (PAGE_CACHE_SIZE - 1);
@@ -808,13 +888,6 @@ static int do_read(struct fsg_common *common)
 			amount = min(amount, (unsigned int)PAGE_CACHE_SIZE -
 					     partial_page);
 
-		/* kever@rk
-		 * max size for dwc_otg ctonroller is 64(max pkt sizt) * 1023(pkt)
-		 * because of the DOEPTSIZ.PKTCNT has only 10 bits
-		 */
-		if((common->gadget->speed != USB_SPEED_HIGH)&&(amount >0x8000))
-		    amount = 0x8000;
-
 		/* Wait for the next buffer to become available */
 		bh = common->next_buffhd_to_fill;
 		while (bh->state != BUF_STATE_EMPTY) {
@@ -839,9 +912,11 @@ static int do_read(struct fsg_common *common)
 
 		/* Perform the read */
 		file_offset_tmp = file_offset;
+		start = ktime_get();
 		nread = vfs_read(curlun->filp,
 				 (char __user *)bh->buf,
 				 amount, &file_offset_tmp);
+		curlun->read_us += ktime_to_us(ktime_sub(ktime_get(), start));
 		VLDBG(curlun, "file read %u @ %llu -> %d\n", amount,
 		      (unsigned long long)file_offset, (int)nread);
 		if (signal_pending(current))
@@ -858,6 +933,7 @@ static int do_read(struct fsg_common *common)
 		file_offset  += nread;
 		amount_left  -= nread;
 		common->residue -= nread;
+		curlun->read_bytes += nread;
 		bh->inreq->length = nread;
 		bh->state = BUF_STATE_FULL;
 
@@ -886,6 +962,150 @@ static int do_read(struct fsg_common *common)
 
 /*-------------------------------------------------------------------------*/
 
+/*
+ * Write a received buffer to the backing file.  Returns the number of
+ * bytes written; a short write is rounded down to a block.
+ */
+static ssize_t fsg_write_buffer(struct fsg_lun *curlun, struct fsg_buffhd *bh,
+				unsigned int amount, loff_t file_offset)
+{
+	loff_t			file_offset_tmp = file_offset;
+	ssize_t			nwritten;
+	ktime_t			start;
+
+	start = ktime_get();
+	nwritten = vfs_write(curlun->filp, (char __user *)bh->buf,
+			     amount, &file_offset_tmp);
+	curlun->write_us += ktime_to_us(ktime_sub(ktime_get(), start));
+	VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
+	      (unsigned long long)file_offset, (int)nwritten);
+
+	if (nwritten < 0) {
+		LDBG(curlun, "error in file write: %d\n", (int)nwritten);
+		nwritten = 0;
+	} else if (nwritten < amount) {
+		LDBG(curlun, "partial file write: %d/%u\n",
+		     (int)nwritten, amount);
+		nwritten -= (nwritten & 511);
+		/* Round down to a block */
+	}
+	curlun->write_bytes += nwritten;
+
+#ifdef MAX_UNFLUSHED_PACKETS
+	curlun->unflushed_packet ++;
+	curlun->unflushed_bytes += nwritten;
+	if( (curlun->unflushed_packet >= MAX_UNFLUSHED_PACKETS) || (curlun->unflushed_bytes >= MAX_UNFLUSHED_BYTES)) {
+		if (!signal_pending(current))
+			fsg_lun_fsync_sub(curlun);
+		curlun->unflushed_packet = 0;
+		curlun->unflushed_bytes = 0;
+	}
+#endif
+	return nwritten;
+}
+
+/*
+ * Write out the oldest write-behind buffer; the caller holds filesem.
+ * The host already has a good status for this data, so a failure can
+ * only be reported as a unit attention on the next command.
+ */
+static void fsg_write_behind_one(struct fsg_common *common)
+{
+	struct fsg_buffhd	*bh = common->next_buffhd_to_drain;
+	struct fsg_lun		*curlun = common->wb_lun;
+	unsigned int		amount = bh->bulk_out_intended_length;
+	ssize_t			nwritten = 0;
+
+	if (fsg_lun_is_open(curlun))
+		nwritten = fsg_write_buffer(curlun, bh, amount,
+					    common->wb_offset);
+	if (nwritten < amount) {
+		LERROR(curlun, "deferred write %u @ %llu failed\n", amount,
+		       (unsigned long long)common->wb_offset);
+		curlun->deferred_errors++;
+		curlun->unit_attention_data = SS_WRITE_ERROR;
+	}
+
+	common->wb_offset += amount;
+	bh->state = BUF_STATE_EMPTY;
+	common->next_buffhd_to_drain = bh->next;
+	if (--common->wb_pending == 0)
+		common->wb_lun = NULL;
+}
+
+static void fsg_write_behind_flush(struct fsg_common *common)
+{
+	if (!common->wb_pending)
+		return;
+
+	down_read(&common->filesem);
+	while (common->wb_pending)
+		fsg_write_behind_one(common);
+	up_read(&common->filesem);
+}
+
+/*
+ * The LUN's medium is being ejected through sysfs; filesem is held for
+ * writing, so the worker thread is not touching the queue.  The host has
+ * already been told this data is written.
+ */
+static void fsg_lun_drain_write_behind(struct fsg_lun *curlun,
+				       struct rw_semaphore *filesem)
+{
+	struct fsg_common *common =
+		container_of(filesem, struct fsg_common, filesem);
+
+	if (common->wb_lun != curlun)
+		return;
+
+	while (common->wb_pending)
+		fsg_write_behind_one(common);
+	wakeup_thread(common);
+}
+
+/*
+ * Called once all of a WRITE's data has been requested.  If the buffers
+ * still to be drained hold the rest of the command, have all arrived
+ * intact and fit in the write-behind budget, leave them to be written
+ * after the status has been sent.
+ */
+static int fsg_write_behind_start(struct fsg_common *common,
+				  struct fsg_lun *curlun,
+				  loff_t file_offset, u32 amount_left)
+{
+	struct fsg_buffhd	*bh = common->next_buffhd_to_drain;
+	unsigned int		n = 0;
+	u32			amount = 0;
+
+	if (!common->wb_max || common->wb_pending ||
+	    common->usb_amount_left > 0 ||
+	    (curlun->filp->f_flags & O_SYNC))
+		return 0;
+
+	do {
+		if (bh->state != BUF_STATE_FULL || ++n > common->wb_max)
+			return 0;
+		smp_rmb();
+		if (bh->outreq->status != 0 ||
+		    bh->outreq->actual != bh->outreq->length)
+			return 0;
+		amount += bh->outreq->actual;
+		bh = bh->next;
+	} while (bh != common->next_buffhd_to_fill);
+
+	if (amount != amount_left ||
+	    curlun->file_length - file_offset < amount)
+		return 0;
+
+	common->wb_pending = n;
+	common->wb_lun = curlun;
+	common->wb_offset = file_offset;
+	common->wb_this_cmnd = 1;
+	common->residue -= amount;
+	curlun->deferred_writes += n;
+	return 1;
+}
+
 static int do_write(struct fsg_common *common)
 {
 	struct fsg_lun		*curlun = common->curlun;
@@ -893,7 +1113,7 @@ static int do_write(struct fsg_common *common)
 	struct fsg_buffhd	*bh;
 	int			get_some_more;
 	u32			amount_left_to_req, amount_left_to_write;
-	loff_t			usb_offset, file_offset, file_offset_tmp;
+	loff_t			usb_offset, file_offset;
 	unsigned int		amount;
 	unsigned int		partial_page;
 	ssize_t			nwritten;
@@ -960,7 +1180,7 @@ static int do_write(struct fsg_common *common)
 			 *	to write past the end of file.
 			 * Finally, round down to a block boundary.
 			 */
-			amount = min(amount_left_to_req, FSG_BUFLEN);
+			amount = min(amount_left_to_req, fsg_xfer_len(common));
 			amount = min((loff_t)amount,
 				     curlun->file_length - usb_offset);
 			partial_page = usb_offset & (PAGE_CACHE_SIZE - 1);
@@ -993,13 +1213,6 @@ static int do_write(struct fsg_common *common)
 			amount_left_to_req -= amount;
 			if (amount_left_to_req == 0)
 				get_some_more = 0;
-				
-			/* kever@rk
-			 * max size for dwc_otg ctonroller is 64(max pkt sizt) * 1023(pkt)
-			 * because of the DOEPTSIZ.PKTCNT has only 10 bits
-			 */
-			if((common->gadget->speed != USB_SPEED_HIGH)&&(amount >0x8000))
-			    amount = 0x8000;
 
 			/*
 			 * amount is always divisible by 512, hence by
@@ -1017,8 +1230,19 @@ static int do_write(struct fsg_common *common)
 
 		/* Write the received data to the backing file */
 		bh = common->next_buffhd_to_drain;
+		if (common->wb_pending) {
+			/* What the previous WRITE left behind goes first */
+			fsg_write_behind_one(common);
+			if (signal_pending(current))
+				return -EINTR;		/* Interrupted! */
+			continue;
+		}
 		if (bh->state == BUF_STATE_EMPTY && !get_some_more)
 			break;			/* We stopped early */
+		if (!get_some_more &&
+		    fsg_write_behind_start(common, curlun, file_offset,
+					   amount_left_to_write))
+			break;			/* Finish after the status */
 		if (bh->state == BUF_STATE_FULL) {
 			smp_rmb();
 			common->next_buffhd_to_drain = bh->next;
@@ -1042,38 +1266,15 @@ static int do_write(struct fsg_common *common)
 			}
 
 			/* Perform the write */
-			file_offset_tmp = file_offset;
-			nwritten = vfs_write(curlun->filp,
-					     (char __user *)bh->buf,
-					     amount, &file_offset_tmp);
-			VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
-			      (unsigned long long)file_offset, (int)nwritten);
+			nwritten = fsg_write_buffer(curlun, bh, amount,
+						    file_offset);
 			if (signal_pending(current))
 				return -EINTR;		/* Interrupted! */
 
-			if (nwritten < 0) {
-				LDBG(curlun, "error in file write: %d\n",
-				     (int)nwritten);
-				nwritten = 0;
-			} else if (nwritten < amount) {
-				LDBG(curlun, "partial file write: %d/%u\n",
-				     (int)nwritten, amount);
-				nwritten -= (nwritten & 511);
-				/* Round down to a block */
-			}
 			file_offset += nwritten;
 			amount_left_to_write -= nwritten;
 			common->residue -= nwritten;
 
-#ifdef MAX_UNFLUSHED_PACKETS
-			curlun->unflushed_packet ++;
-			curlun->unflushed_bytes += nwritten;
-			if( (curlun->unflushed_packet >= MAX_UNFLUSHED_PACKETS) || (curlun->unflushed_bytes >= MAX_UNFLUSHED_BYTES)) {
-				fsg_lun_fsync_sub(curlun);
-				curlun->unflushed_packet = 0;
-				curlun->unflushed_bytes = 0;
-			}
-#endif
 			/* If an error occurred, report it and its position */
 			if (nwritten < amount) {
 				curlun->sense_data = SS_WRITE_ERROR;
@@ -1185,7 +1386,7 @@ static int do_verify(struct fsg_common *common)
 		 * If this means reading 0 then we were asked to read
 		 * past the end of file.
 		 */
-		amount = min(amount_left, FSG_BUFLEN);
+		amount = min(amount_left, common->buflen);
 		amount = min((loff_t)amount,
 			     curlun->file_length - file_offset);
 		if (amount == 0) {
@@ -1654,7 +1855,8 @@ static int throw_away_data(struct fsg_common *common)
 		bh = common->next_buffhd_to_fill;
 		if (bh->state == BUF_STATE_EMPTY
 		 && common->usb_amount_left > 0) {
-			amount = min(common->usb_amount_left, FSG_BUFLEN);
+			amount = min(common->usb_amount_left,
+				     fsg_xfer_len(common));
 
 			/*
 			 * amount is always divisible by 512, hence by
@@ -2134,9 +2336,25 @@ static int do_scsi_command(struct fsg_common *common)
 
 	dump_cdb(common);
 
+	/*
+	 * Data left behind by the previous WRITE is written out before
+	 * anything else runs, except another WRITE which drains it while
+	 * its own data comes in.
+	 */
+	common->wb_this_cmnd = 0;
+	switch (common->cmnd[0]) {
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+		break;
+	default:
+		fsg_write_behind_flush(common);
+	}
+
 	/* Wait for the next buffer to become available for data or status */
 	bh = common->next_buffhd_to_fill;
-	common->next_buffhd_to_drain = bh;
+	if (!common->wb_pending)
+		common->next_buffhd_to_drain = bh;
 	while (bh->state != BUF_STATE_EMPTY) {
 		rc = sleep_thread(common);
 		if (rc)
@@ -2407,6 +2625,10 @@ unknown_cmnd:
 	if (reply == -EINTR || signal_pending(current))
 		return -EINTR;
 
+	/* A WRITE that failed early must not leave older data queued */
+	if (!common->wb_this_cmnd)
+		fsg_write_behind_flush(common);
+
 	/* Set up the single reply buffer for finish_reply() */
 	if (reply == -EINVAL)
 		reply = 0;		/* Error reply length */
@@ -2569,7 +2791,7 @@ reset:
 	if (common->fsg) {
 		fsg = common->fsg;
 
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->fsg_num_buffers; ++i) {
 			struct fsg_buffhd *bh = &common->buffhds[i];
 
 			if (bh->inreq) {
@@ -2623,7 +2845,7 @@ reset:
 	clear_bit(IGNORE_BULK_OUT, &fsg->atomic_bitflags);
 
 	/* Allocate the requests */
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
 		struct fsg_buffhd	*bh = &common->buffhds[i];
 
 		rc = alloc_request(common, fsg->bulk_in, &bh->inreq);
@@ -2692,7 +2914,7 @@ static void handle_exception(struct fsg_common *common)
 
 	/* Cancel all the pending transfers */
 	if (likely(common->fsg)) {
-		for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+		for (i = 0; i < common->fsg_num_buffers; ++i) {
 			bh = &common->buffhds[i];
 			if (bh->inreq_busy)
 				usb_ep_dequeue(common->fsg->bulk_in, bh->inreq);
@@ -2704,7 +2926,7 @@ static void handle_exception(struct fsg_common *common)
 		/* Wait until everything is idle */
 		for (;;) {
 			int num_active = 0;
-			for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+			for (i = 0; i < common->fsg_num_buffers; ++i) {
 				bh = &common->buffhds[i];
 				num_active += bh->inreq_busy + bh->outreq_busy;
 			}
@@ -2721,13 +2943,16 @@ static void handle_exception(struct fsg_common *common)
 			usb_ep_fifo_flush(common->fsg->bulk_out);
 	}
 
+	/* The host has been told this data is written; don't drop it */
+	fsg_write_behind_flush(common);
+
 	/*
 	 * Reset the I/O buffer states and pointers, the SCSI
 	 * state, and the exception.  Then invoke the handler.
 	 */
 	spin_lock_irq(&common->lock);
 
-	for (i = 0; i < FSG_NUM_BUFFERS; ++i) {
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
 		bh = &common->buffhds[i];
 		bh->state = BUF_STATE_EMPTY;
 	}
@@ -2905,6 +3130,29 @@ static DEVICE_ATTR(ro, 0644, fsg_show_ro, fsg_store_ro);
 static DEVICE_ATTR(nofua, 0644, fsg_show_nofua, fsg_store_nofua);
 static DEVICE_ATTR(file, 0644, fsg_show_file, fsg_store_file);
 
+static u64 fsg_kbps(u64 bytes, u64 us)
+{
+	return us ? div64_u64((bytes >> 10) * USEC_PER_SEC, us) : 0;
+}
+
+/* Backing file throughput, as seen by the thread doing the I/O */
+static ssize_t fsg_show_xfer_stats(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct fsg_lun	*curlun = fsg_lun_from_dev(dev);
+
+	return sprintf(buf, "read: %llu bytes in %llu us, %llu KB/s\n"
+		       "write: %llu bytes in %llu us, %llu KB/s\n"
+		       "write-behind: %lu buffers, %lu errors\n",
+		       curlun->read_bytes, curlun->read_us,
+		       fsg_kbps(curlun->read_bytes, curlun->read_us),
+		       curlun->write_bytes, curlun->write_us,
+		       fsg_kbps(curlun->write_bytes, curlun->write_us),
+		       curlun->deferred_writes, curlun->deferred_errors);
+}
+
+static DEVICE_ATTR(xfer_stats, 0444, fsg_show_xfer_stats, NULL);
+
 
 /****************************** FSG COMMON ******************************/
 
@@ -2925,12 +3173,61 @@ static inline void fsg_common_put(struct fsg_common *common)
 	kref_put(&common->ref, fsg_common_release);
 }
 
+static void fsg_common_free_buffers(struct fsg_common *common)
+{
+	unsigned i;
+
+	for (i = 0; i < common->fsg_num_buffers; ++i) {
+		kfree(common->buffhds[i].buf);
+		common->buffhds[i].buf = NULL;
+	}
+}
+
+static int fsg_common_alloc_buffers(struct fsg_common *common)
+{
+	struct fsg_buffhd *bh;
+	unsigned i;
+
+	common->fsg_num_buffers = clamp(fsg_num_buffers, 2u,
+					(unsigned)FSG_MAX_NUM_BUFFERS);
+	common->buflen = clamp(fsg_buflen & ~511u, FSG_BUFLEN,
+			       (u32)FSG_MAX_BUFLEN);
+	common->wb_max = min(fsg_write_behind, common->fsg_num_buffers - 2);
+
+	common->buffhds = kcalloc(common->fsg_num_buffers,
+				  sizeof *common->buffhds, GFP_KERNEL);
+	if (unlikely(!common->buffhds))
+		return -ENOMEM;
+
+retry:
+	bh = common->buffhds;
+	i = common->fsg_num_buffers;
+	goto buffhds_first_it;
+	do {
+		bh->next = bh + 1;
+		++bh;
+buffhds_first_it:
+		bh->buf = kmalloc(common->buflen, GFP_KERNEL);
+		if (unlikely(!bh->buf)) {
+			fsg_common_free_buffers(common);
+			if (common->buflen == FSG_BUFLEN)
+				return -ENOMEM;
+			WARNING(common, "can't allocate %u byte buffers, "
+				"falling back to %u\n", common->buflen,
+				FSG_BUFLEN);
+			common->buflen = FSG_BUFLEN;
+			goto retry;
+		}
+	} while (--i);
+	bh->next = common->buffhds;
+	return 0;
+}
+
 static struct fsg_common *fsg_common_init(struct fsg_common *common,
 					  struct usb_composite_dev *cdev,
 					  struct fsg_config *cfg)
 {
 	struct usb_gadget *gadget = cdev->gadget;
-	struct fsg_buffhd *bh;
 	struct fsg_lun *curlun;
 	struct fsg_lun_config *lcfg;
 	int nluns, i, rc;
@@ -3014,6 +3311,9 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 		if (rc)
 			goto error_luns;
 		rc = device_create_file(&curlun->dev, &dev_attr_nofua);
+		if (rc)
+			goto error_luns;
+		rc = device_create_file(&curlun->dev, &dev_attr_xfer_stats);
 		if (rc)
 			goto error_luns;
 
@@ -3030,20 +3330,9 @@ static struct fsg_common *fsg_common_init(struct fsg_common *common,
 	common->nluns = nluns;
 
 	/* Data buffers cyclic list */
-	bh = common->buffhds;
-	i = FSG_NUM_BUFFERS;
-	goto buffhds_first_it;
-	do {
-		bh->next = bh + 1;
-		++bh;
-buffhds_first_it:
-		bh->buf = kmalloc(FSG_BUFLEN, GFP_KERNEL);
-		if (unlikely(!bh->buf)) {
-			rc = -ENOMEM;
-			goto error_release;
-		}
-	} while (--i);
-	bh->next = common->buffhds;
+	rc = fsg_common_alloc_buffers(common);
+	if (unlikely(rc))
+		goto error_release;
 
 	/* Prepare inquiryString */
 	if (cfg->release != 0xffff) {
@@ -3145,6 +3434,7 @@ static void fsg_common_release(struct kref *ref)
 
 		/* In error recovery common->nluns may be zero. */
 		for (; i; --i, ++lun) {
+			device_remove_file(&lun->dev, &dev_attr_xfer_stats);
 			device_remove_file(&lun->dev, &dev_attr_nofua);
 			device_remove_file(&lun->dev, &dev_attr_ro);
 			device_remove_file(&lun->dev, &dev_attr_file);
@@ -3155,12 +3445,9 @@ static void fsg_common_release(struct kref *ref)
 		kfree(common->luns);
 	}
 
-	{
-		struct fsg_buffhd *bh = common->buffhds;
-		unsigned i = FSG_NUM_BUFFERS;
-		do {
-			kfree(bh->buf);
-		} while (++bh, --i);
+	if (common->buffhds) {
+		fsg_common_free_buffers(common);
+		kfree(common->buffhds);
 	}
 
 	if (common->free_storage_on_release)
@@ -30,6 +30,12 @@
 #include <linux/file.h>
 #include <linux/device.h>
 #include <linux/miscdevice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/pagemap.h>
+#include <linux/backing-dev.h>
 
 #include <linux/usb.h>
 #include <linux/usb_usual.h>
@@ -54,6 +60,35 @@
 #define RX_REQ_MAX 2
 #define INTR_REQ_MAX 5
 
+/*
+ * File transfers use a deeper ring of larger requests, so that vfs_read
+ * and vfs_write of one buffer overlap with the USB transfer of the others.
+ * If the large buffers can't be allocated we fall back to TX_REQ_MAX and
+ * RX_REQ_MAX requests of MTP_BULK_BUFFER_SIZE.
+ */
+#define MTP_XFER_REQ_LIMIT 16
+
+static unsigned int mtp_tx_req_len = 65536;
+module_param(mtp_tx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_req_len, "MTP tx request length, applied on bind");
+
+static unsigned int mtp_tx_reqs = 8;
+module_param(mtp_tx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_tx_reqs, "MTP tx requests, applied on bind");
+
+static unsigned int mtp_rx_req_len = 65536;
+module_param(mtp_rx_req_len, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_req_len, "MTP rx request length, applied on bind");
+
+static unsigned int mtp_rx_reqs = 8;
+module_param(mtp_rx_reqs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_reqs, "MTP rx requests, applied on bind");
+
+/* start write-back of received file data every this many KB, 0 = never */
+static unsigned int mtp_rx_writeback_kb = 1024;
+module_param(mtp_rx_writeback_kb, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(mtp_rx_writeback_kb, "start write-back of received files every N KB");
+
 /* ID for Microsoft MTP OS String */
 #define MTP_OS_STRING_ID   0xEE
 
@@ -92,8 +127,14 @@ struct mtp_dev {
 	wait_queue_head_t read_wq;
 	wait_queue_head_t write_wq;
 	wait_queue_head_t intr_wq;
-	struct usb_request *rx_req[RX_REQ_MAX];
-	int rx_done;
+	struct usb_request *rx_req[MTP_XFER_REQ_LIMIT];
+	/* rx requests completed since last reset; they complete in order */
+	unsigned rx_done;
+
+	unsigned tx_req_len;
+	unsigned tx_reqs;
+	unsigned rx_req_len;
+	unsigned rx_reqs;
 
 	/* for processing MTP_SEND_FILE, MTP_RECEIVE_FILE and
 	 * MTP_SEND_FILE_WITH_HEADER ioctls on a work queue
@@ -108,6 +149,16 @@ struct mtp_dev {
 	uint16_t xfer_command;
 	uint32_t xfer_transaction_id;
 	int xfer_result;
+
+	/* file transfer statistics, [0] send and [1] receive */
+	struct mtp_xfer_stats {
+		unsigned long files;
+		u64 bytes;
+		u64 ns;
+		unsigned last_kbps;
+		unsigned max_kbps;
+	} xfer_stats[2];
+	struct dentry *debugfs;
 };
 
 static struct usb_interface_descriptor mtp_interface_desc = {
@@ -361,8 +412,10 @@ static void mtp_complete_out(struct usb_ep *ep, struct usb_request *req)
 {
 	struct mtp_dev *dev = _mtp_dev;
 
-	dev->rx_done = 1;
-	if ((req->status != 0) && (dev->state != STATE_CANCELED))
+	dev->rx_done++;
+	/* requests we dequeue ourselves at the end of a transfer are no error */
+	if ((req->status != 0) && (req->status != -ECONNRESET) &&
+	    (dev->state != STATE_CANCELED))
 		dev->state = STATE_ERROR;
 
 	wake_up(&dev->read_wq);
@@ -420,17 +473,40 @@ static int mtp_create_bulk_endpoints(struct mtp_dev *dev,
 	dev->ep_intr = ep;
 
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_in, MTP_BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+	dev->tx_req_len = max_t(unsigned, mtp_tx_req_len, MTP_BULK_BUFFER_SIZE);
+	dev->tx_reqs = clamp_t(unsigned, mtp_tx_reqs, 1, MTP_XFER_REQ_LIMIT);
+retry_tx_alloc:
+	for (i = 0; i < dev->tx_reqs; i++) {
+		req = mtp_request_new(dev->ep_in, dev->tx_req_len);
+		if (!req) {
+			if (dev->tx_req_len == MTP_BULK_BUFFER_SIZE)
+				goto fail;
+			while ((req = mtp_req_get(dev, &dev->tx_idle)))
+				mtp_request_free(req, dev->ep_in);
+			dev->tx_req_len = MTP_BULK_BUFFER_SIZE;
+			dev->tx_reqs = TX_REQ_MAX;
+			goto retry_tx_alloc;
+		}
 		req->complete = mtp_complete_in;
 		mtp_req_put(dev, &dev->tx_idle, req);
 	}
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = mtp_request_new(dev->ep_out, MTP_BULK_BUFFER_SIZE);
-		if (!req)
-			goto fail;
+
+	dev->rx_req_len = max_t(unsigned, mtp_rx_req_len, MTP_BULK_BUFFER_SIZE);
+	dev->rx_reqs = clamp_t(unsigned, mtp_rx_reqs, 1, MTP_XFER_REQ_LIMIT);
+retry_rx_alloc:
+	for (i = 0; i < dev->rx_reqs; i++) {
+		req = mtp_request_new(dev->ep_out, dev->rx_req_len);
+		if (!req) {
+			if (dev->rx_req_len == MTP_BULK_BUFFER_SIZE)
+				goto fail;
+			while (--i >= 0) {
+				mtp_request_free(dev->rx_req[i], dev->ep_out);
+				dev->rx_req[i] = NULL;
+			}
+			dev->rx_req_len = MTP_BULK_BUFFER_SIZE;
+			dev->rx_reqs = RX_REQ_MAX;
+			goto retry_rx_alloc;
+		}
 		req->complete = mtp_complete_out;
 		dev->rx_req[i] = req;
 	}
@@ -587,8 +663,8 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 			break;
 		}
 
-		if (count > MTP_BULK_BUFFER_SIZE)
-			xfer = MTP_BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 		if (xfer && copy_from_user(req->buf, buf, xfer)) {
@@ -625,18 +701,41 @@ static ssize_t mtp_write(struct file *fp, const char __user *buf,
 	return r;
 }
 
+static void mtp_xfer_account(struct mtp_dev *dev, int dir, u64 bytes,
+		ktime_t start)
+{
+	struct mtp_xfer_stats *st = &dev->xfer_stats[dir];
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned kbps;
+
+	if (!bytes || !ns)
+		return;
+
+	/* bytes per ns to KB/s */
+	kbps = div64_u64(bytes * 976562, ns);
+	st->files++;
+	st->bytes += bytes;
+	st->ns += ns;
+	st->last_kbps = kbps;
+	if (kbps > st->max_kbps)
+		st->max_kbps = kbps;
+}
+
 /* read from a local file and write to USB */
 static void send_file_work(struct work_struct *data) {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, send_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
 	struct usb_request *req = 0;
 	struct mtp_data_header *header;
+	struct backing_dev_info *bdi;
 	struct file *filp;
 	loff_t offset;
 	int64_t count;
 	int xfer, ret, hdr_size;
 	int r = 0;
 	int sendZLP = 0;
+	ktime_t start = ktime_get();
+	u64 sent = 0;
 
 	/* read our parameters */
 	smp_rmb();
@@ -646,6 +745,17 @@ static void send_file_work(struct work_struct *data) {
 
 	DBG(cdev, "send_file_work(%lld %lld)\n", offset, count);
 
+	/* The file is read front to back, so open up readahead like
+	 * POSIX_FADV_SEQUENTIAL would, and at least to the whole tx ring,
+	 * so that the page cache stays ahead of the requests in flight.
+	 */
+	bdi = filp->f_mapping->backing_dev_info;
+	filp->f_ra.ra_pages = max_t(unsigned, bdi->ra_pages * 2,
+		(dev->tx_req_len * dev->tx_reqs) >> PAGE_CACHE_SHIFT);
+	spin_lock(&filp->f_lock);
+	filp->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&filp->f_lock);
+
 	if (dev->xfer_send_header) {
 		hdr_size = sizeof(struct mtp_data_header);
 		count += hdr_size;
@@ -679,8 +789,8 @@ static void send_file_work(struct work_struct *data) {
 			break;
 		}
 
-		if (count > MTP_BULK_BUFFER_SIZE)
-			xfer = MTP_BULK_BUFFER_SIZE;
+		if (count > dev->tx_req_len)
+			xfer = dev->tx_req_len;
 		else
 			xfer = count;
 
@@ -711,6 +821,7 @@ static void send_file_work(struct work_struct *data) {
 		}
 
 		count -= xfer;
+		sent += xfer;
 
 		/* zero this so we don't try to free it on error exit */
 		req = 0;
@@ -719,23 +830,45 @@ static void send_file_work(struct work_struct *data) {
 	if (req)
 		mtp_req_put(dev, &dev->tx_idle, req);
 
+	if (!r)
+		mtp_xfer_account(dev, 0, sent, start);
+
 	DBG(cdev, "send_file_work returning %d\n", r);
 	/* write the result */
 	dev->xfer_result = r;
 	smp_wmb();
 }
 
-/* read from USB and write to a local file */
+/* give back rx requests still queued when a receive ends early */
+static void mtp_rx_dequeue(struct mtp_dev *dev, unsigned tail, unsigned head)
+{
+	unsigned i;
+
+	for (i = tail; i != head; i++)
+		usb_ep_dequeue(dev->ep_out, dev->rx_req[i % dev->rx_reqs]);
+	wait_event_timeout(dev->read_wq, (int)(dev->rx_done - head) >= 0, HZ);
+}
+
+/* read from USB and write to a local file
+ *
+ * Up to rx_reqs requests are kept queued on the OUT endpoint while the
+ * oldest completed one is written to the file. Bulk requests complete in
+ * queue order, so dev->rx_done counts completions and the ring indices
+ * tell which request is done.
+ */
 static void receive_file_work(struct work_struct *data)
 {
 	struct mtp_dev	*dev = container_of(data, struct mtp_dev, receive_file_work);
 	struct usb_composite_dev *cdev = dev->cdev;
-	struct usb_request *read_req = NULL, *write_req = NULL;
+	struct usb_request *req;
 	struct file *filp;
-	loff_t offset;
-	int64_t count;
-	int ret, cur_buf = 0;
+	loff_t offset, wb_start;
+	int64_t count, to_queue;
+	unsigned head = 0, tail = 0, depth;
+	int ret, short_packet;
 	int r = 0;
+	ktime_t start = ktime_get();
+	u64 received = 0;
 
 	/* read our parameters */
 	smp_rmb();
@@ -747,66 +880,89 @@ static void receive_file_work(struct work_struct *data)
     	count ++;
 	DBG(cdev, "receive_file_work(%lld)\n", count);
 
-	while (count > 0 || write_req) {
-		if (count > 0) {
-			/* queue a request */
-			read_req = dev->rx_req[cur_buf];
-			cur_buf = (cur_buf + 1) % RX_REQ_MAX;
+	/* if xfer_file_length is 0xFFFFFFFF, then we read until we get a
+	 * short packet; we can't know how much to queue ahead then.
+	 */
+	depth = (count == 0xFFFFFFFF) ? 1 : dev->rx_reqs;
+	to_queue = count;
+	wb_start = offset;
+	dev->rx_done = 0;
 
-			read_req->length = (count > MTP_BULK_BUFFER_SIZE
-					? MTP_BULK_BUFFER_SIZE : count);
-			dev->rx_done = 0;
-			ret = usb_ep_queue(dev->ep_out, read_req, GFP_KERNEL);
+	while (1) {
+		/* keep the pipeline full */
+		while (to_queue > 0 && head - tail < depth) {
+			req = dev->rx_req[head % dev->rx_reqs];
+			req->length = (to_queue > dev->rx_req_len
+					? dev->rx_req_len : to_queue);
+			ret = usb_ep_queue(dev->ep_out, req, GFP_KERNEL);
 			if (ret < 0) {
 				r = -EIO;
 				dev->state = STATE_ERROR;
 				break;
 			}
+			head++;
+			if (count != 0xFFFFFFFF)
+				to_queue -= req->length;
 		}
+		if (r || head == tail)
+			break;
 
-		if (write_req) {
-			DBG(cdev, "rx %p %d\n", write_req, write_req->actual);
-			ret = vfs_write(filp, write_req->buf, write_req->actual,
-				&offset);
-			DBG(cdev, "vfs_write %d\n", ret);
-			if (ret != write_req->actual) {
-				r = -EIO;
-				dev->state = STATE_ERROR;
-				break;
-			}
-			write_req = NULL;
+		/* wait for the oldest read to complete */
+		req = dev->rx_req[tail % dev->rx_reqs];
+		ret = wait_event_interruptible(dev->read_wq,
+			(int)(dev->rx_done - tail) > 0 ||
+			(dev->state != STATE_BUSY));
+		if (dev->state == STATE_CANCELED) {
+			r = -ECANCELED;
+			break;
+		}
+		if ((int)(dev->rx_done - tail) <= 0) {
+			/* error or signal before the read finished */
+			r = ret < 0 ? ret : -EIO;
+			break;
 		}
+		tail++;
 
-		if (read_req) {
-			/* wait for our last read to complete */
-			ret = wait_event_interruptible(dev->read_wq,
-				dev->rx_done || (dev->state != STATE_BUSY));
-			if (dev->state == STATE_CANCELED) {
-				r = -ECANCELED;
-				if (!dev->rx_done)
-					usb_ep_dequeue(dev->ep_out, read_req);
-				break;
-			}
-			/* if xfer_file_length is 0xFFFFFFFF, then we read until
-			 * we get a zero length packet
-			 */
-			if (count != 0xFFFFFFFF)
-				count -= read_req->actual;
-			if (read_req->actual < read_req->length) {
-				/* short packet is used to signal EOF for sizes > 4 gig */
-				DBG(cdev, "got short packet\n");
-				count = 0;
-				/* yk@20120509 usb disconnect will couse short packet, 
-				 * and dev state change to STATE_OFFLINE */
-                if(dev->state != STATE_BUSY)
-                    r = -EIO;
-			}
+		DBG(cdev, "rx %p %d\n", req, req->actual);
+		short_packet = req->actual < req->length;
+		if (count != 0xFFFFFFFF)
+			count -= req->actual;
 
-			write_req = read_req;
-			read_req = NULL;
+		ret = vfs_write(filp, req->buf, req->actual, &offset);
+		DBG(cdev, "vfs_write %d\n", ret);
+		if (ret != req->actual) {
+			r = -EIO;
+			dev->state = STATE_ERROR;
+			break;
+		}
+		received += req->actual;
+
+		/* start write-back now rather than in one burst at close */
+		if (mtp_rx_writeback_kb &&
+		    offset - wb_start >= (loff_t)mtp_rx_writeback_kb << 10) {
+			filemap_fdatawrite_range(filp->f_mapping, wb_start,
+						 offset - 1);
+			wb_start = offset;
+		}
+
+		if (short_packet) {
+			/* short packet is used to signal EOF for sizes > 4 gig */
+			DBG(cdev, "got short packet\n");
+			count = 0;
+			/* yk@20120509 usb disconnect will couse short packet, 
+			 * and dev state change to STATE_OFFLINE */
+			if(dev->state != STATE_BUSY)
+				r = -EIO;
+			break;
 		}
 	}
 
+	if (head != tail)
+		mtp_rx_dequeue(dev, tail, head);
+
+	if (!r)
+		mtp_xfer_account(dev, 1, received, start);
+
 	DBG(cdev, "receive_file_work returning %d\n", r);
 	/* write the result */
 	dev->xfer_result = r;
@@ -1129,8 +1285,10 @@ mtp_function_unbind(struct usb_configuration *c, struct usb_function *f)
 
 	while ((req = mtp_req_get(dev, &dev->tx_idle)))
 		mtp_request_free(req, dev->ep_in);
-	for (i = 0; i < RX_REQ_MAX; i++)
+	for (i = 0; i < MTP_XFER_REQ_LIMIT; i++) {
 		mtp_request_free(dev->rx_req[i], dev->ep_out);
+		dev->rx_req[i] = NULL;
+	}
 	while ((req = mtp_req_get(dev, &dev->intr_idle)))
 		mtp_request_free(req, dev->ep_intr);
 	dev->state = STATE_OFFLINE;
@@ -1227,6 +1385,39 @@ static int mtp_bind_config(struct usb_configuration *c, bool ptp_config)
 	return usb_add_function(c, &dev->function);
 }
 
+static int mtp_xfer_stats_show(struct seq_file *s, void *unused)
+{
+	struct mtp_dev *dev = s->private;
+	static const char * const dir[] = { "send", "receive" };
+	int i;
+
+	seq_printf(s, "tx: %u x %u bytes, rx: %u x %u bytes\n",
+		   dev->tx_reqs, dev->tx_req_len, dev->rx_reqs, dev->rx_req_len);
+	seq_printf(s, "%-8s %8s %14s %10s %10s %10s\n", "",
+		   "files", "bytes", "avg_KB/s", "last_KB/s", "max_KB/s");
+	for (i = 0; i < 2; i++) {
+		struct mtp_xfer_stats *st = &dev->xfer_stats[i];
+		unsigned avg = st->ns ? div64_u64(st->bytes * 976562, st->ns) : 0;
+
+		seq_printf(s, "%-8s %8lu %14llu %10u %10u %10u\n", dir[i],
+			   st->files, st->bytes, avg, st->last_kbps,
+			   st->max_kbps);
+	}
+	return 0;
+}
+
+static int mtp_xfer_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mtp_xfer_stats_show, inode->i_private);
+}
+
+static const struct file_operations mtp_xfer_stats_fops = {
+	.open		= mtp_xfer_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int mtp_setup(void)
 {
 	struct mtp_dev *dev;
@@ -1260,6 +1451,9 @@ static int mtp_setup(void)
 	if (ret)
 		goto err2;
 
+	dev->debugfs = debugfs_create_file("mtp_xfer", S_IRUGO, NULL, dev,
+					   &mtp_xfer_stats_fops);
+
 	return 0;
 
 err2:
@@ -1278,6 +1472,7 @@ static void mtp_cleanup(void)
 	if (!dev)
 		return;
 
+	debugfs_remove(dev->debugfs);
 	misc_deregister(&mtp_device);
 	destroy_workqueue(dev->wq);
 	_mtp_dev = NULL;
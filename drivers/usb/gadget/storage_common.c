@@ -52,6 +52,16 @@
  * characters rather then a pointer to void.
  */
 
+/*
+ * When FSG_LUN_XFER_STATS is defined the fsg_lun structure carries
+ * read and write throughput counters for the including driver to fill.
+ *
+ * When FSG_LUN_WRITE_BEHIND is defined the including driver must provide
+ * fsg_lun_drain_write_behind(), which writes out any data still queued for
+ * the LUN.  It is called with filesem held for writing before the backing
+ * file is closed from sysfs.
+ */
+
 
 #include <linux/usb/storage.h>
 #include <scsi/scsi.h>
@@ -237,6 +247,14 @@ struct fsg_lun {
 	unsigned int	unflushed_packet;
 	unsigned int	unflushed_bytes;
 #endif
+#ifdef FSG_LUN_XFER_STATS
+	u64		read_bytes;
+	u64		read_us;	/* time spent in vfs_read */
+	u64		write_bytes;
+	u64		write_us;	/* time spent in vfs_write */
+	unsigned long	deferred_writes;
+	unsigned long	deferred_errors;
+#endif
 
 	unsigned int	initially_ro:1;
 	unsigned int	ro:1;
@@ -616,6 +634,11 @@ out:
 }
 
 
+#ifdef FSG_LUN_WRITE_BEHIND
+static void fsg_lun_drain_write_behind(struct fsg_lun *curlun,
+				       struct rw_semaphore *filesem);
+#endif
+
 static void fsg_lun_close(struct fsg_lun *curlun)
 {
 	if (curlun->filp) {
@@ -788,6 +811,9 @@ static ssize_t fsg_store_file(struct device *dev, struct device_attribute *attr,
 	/* Eject current medium */
 	down_write(filesem);
 	if (fsg_lun_is_open(curlun)) {
+#ifdef FSG_LUN_WRITE_BEHIND
+		fsg_lun_drain_write_behind(curlun, filesem);
+#endif
 		fsg_lun_close(curlun);
 		curlun->unit_attention_data = SS_MEDIUM_NOT_PRESENT;
 	}
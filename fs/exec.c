@@ -969,6 +969,9 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+
+		/* The old leader was what oom_adj listeners were tracking */
+		oom_adj_changed(tsk);
 	}
 
 	sig->group_exit_task = NULL;
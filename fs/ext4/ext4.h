@@ -1172,6 +1172,8 @@ struct ext4_sb_info {
 	unsigned int s_mb_order2_reqs;
 	unsigned int s_mb_group_prealloc;
 	unsigned int s_max_writeback_mb_bump;
+	unsigned int s_discard_interval;	/* msecs, 0 = discard at commit */
+	unsigned int s_discard_max_blocks;	/* per background run */
 	/* where last allocation was done - for stream allocation */
 	unsigned long s_mb_last_group;
 	unsigned long s_mb_last_start;
@@ -1192,6 +1194,15 @@ struct ext4_sb_info {
 	atomic_t s_mb_discarded;
 	atomic_t s_lock_busy;
 
+	/* freed extents waiting for a background discard */
+	spinlock_t s_discard_lock;
+	struct rb_root s_discard_root;
+	struct delayed_work s_discard_work;
+	unsigned long s_discard_pending_extents;
+	unsigned long s_discard_pending_blocks;
+	unsigned long s_discard_issued_extents;
+	unsigned long s_discard_issued_blocks;
+
 	/* locality groups */
 	struct ext4_locality_group __percpu *s_locality_groups;
 
@@ -356,6 +356,9 @@ static void ext4_mb_generate_from_pa(struct super_block *sb, void *bitmap,
 static void ext4_mb_generate_from_freelist(struct super_block *sb, void *bitmap,
 						ext4_group_t group);
 static void release_blocks_on_commit(journal_t *journal, transaction_t *txn);
+static void ext4_queue_discard(struct super_block *sb,
+			       struct ext4_free_data *entry);
+static void ext4_discard_work(struct work_struct *work);
 
 static inline void *mb_correct_addr_and_bit(int *bit, void *addr)
 {
@@ -2472,6 +2475,11 @@ int ext4_mb_init(struct super_block *sb, int needs_recovery)
 	sbi->s_mb_stream_request = MB_DEFAULT_STREAM_THRESHOLD;
 	sbi->s_mb_order2_reqs = MB_DEFAULT_ORDER2_REQS;
 	sbi->s_mb_group_prealloc = MB_DEFAULT_GROUP_PREALLOC;
+	sbi->s_discard_interval = MB_DEFAULT_DISCARD_INTERVAL;
+	sbi->s_discard_max_blocks = MB_DEFAULT_DISCARD_MAX_BLOCKS;
+	spin_lock_init(&sbi->s_discard_lock);
+	sbi->s_discard_root = RB_ROOT;
+	INIT_DELAYED_WORK(&sbi->s_discard_work, ext4_discard_work);
 
 	sbi->s_locality_groups = alloc_percpu(struct ext4_locality_group);
 	if (sbi->s_locality_groups == NULL) {
@@ -2527,10 +2535,19 @@ int ext4_mb_release(struct super_block *sb)
 	struct ext4_group_info *grinfo;
 	struct ext4_sb_info *sbi = EXT4_SB(sb);
 	struct kmem_cache *cachep = get_groupinfo_cache(sb->s_blocksize_bits);
+	struct rb_node *n;
 
 	if (sbi->s_proc)
 		remove_proc_entry("mb_groups", sbi->s_proc);
 
+	/* the journal is gone by now, so nothing can be queued behind us */
+	cancel_delayed_work_sync(&sbi->s_discard_work);
+	while ((n = rb_first(&sbi->s_discard_root))) {
+		rb_erase(n, &sbi->s_discard_root);
+		kmem_cache_free(ext4_free_ext_cachep,
+				rb_entry(n, struct ext4_free_data, node));
+	}
+
 	if (sbi->s_group_info) {
 		for (i = 0; i < ngroups; i++) {
 			grinfo = ext4_get_group_info(sb, i);
@@ -2605,6 +2622,9 @@ static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 	int err, count = 0, count2 = 0;
 	struct ext4_free_data *entry;
 	struct list_head *l, *ltmp;
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	int discard = test_opt(sb, DISCARD);
+	int discard_later;
 
 	list_for_each_safe(l, ltmp, &txn->t_private_list) {
 		entry = list_entry(l, struct ext4_free_data, list);
@@ -2612,7 +2632,10 @@ static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 		mb_debug(1, "gonna free %u blocks in group %u (0x%p):",
 			 entry->count, entry->group, entry);
 
-		if (test_opt(sb, DISCARD))
+		discard_later = discard && sbi->s_discard_interval &&
+			ACCESS_ONCE(sbi->s_discard_pending_extents) <
+				MB_DISCARD_MAX_PENDING;
+		if (discard && !discard_later)
 			ext4_issue_discard(sb, entry->group,
 					   entry->start_blk, entry->count);
 
@@ -2637,7 +2660,11 @@ static void release_blocks_on_commit(journal_t *journal, transaction_t *txn)
 			page_cache_release(e4b.bd_bitmap_page);
 		}
 		ext4_unlock_group(sb, entry->group);
-		kmem_cache_free(ext4_free_ext_cachep, entry);
+		/* the entry is off the group tree, reuse it for the queue */
+		if (discard_later)
+			ext4_queue_discard(sb, entry);
+		else
+			kmem_cache_free(ext4_free_ext_cachep, entry);
 		ext4_mb_unload_buddy(&e4b);
 	}
 
@@ -4956,3 +4983,138 @@ int ext4_trim_fs(struct super_block *sb, struct fstrim_range *range)
 
 	return ret;
 }
+
+/*
+ * Background discard.  Instead of discarding every freed extent from the
+ * commit callback, release_blocks_on_commit() hands the extents to a per
+ * filesystem rb tree sorted by (group, start) in which neighbours are
+ * coalesced.  ext4_discard_work() drains it through ext4_trim_all_free(),
+ * so blocks that were reallocated in the meantime are skipped, and only
+ * while the device has no other requests outstanding.  Each run issues
+ * at most s_discard_max_blocks; runs are s_discard_interval msecs apart.
+ * Once MB_DISCARD_MAX_PENDING extents are queued, further ones are
+ * discarded at commit time, so the tree stays bounded.
+ */
+static unsigned long ext4_discard_delay(struct ext4_sb_info *sbi)
+{
+	return msecs_to_jiffies(sbi->s_discard_interval ?:
+				MB_DEFAULT_DISCARD_INTERVAL);
+}
+
+/*
+ * Merge @b into @a if they overlap or touch; @a must sort before @b.
+ * Needs s_discard_lock.
+ */
+static int ext4_discard_try_merge(struct ext4_sb_info *sbi,
+				  struct ext4_free_data *a,
+				  struct ext4_free_data *b)
+{
+	ext4_grpblk_t end;
+
+	if (a->group != b->group || a->start_blk + a->count < b->start_blk)
+		return 0;
+
+	end = max(a->start_blk + a->count, b->start_blk + b->count);
+	sbi->s_discard_pending_blocks -= a->count + b->count;
+	a->count = end - a->start_blk;
+	sbi->s_discard_pending_blocks += a->count;
+	sbi->s_discard_pending_extents--;
+	rb_erase(&b->node, &sbi->s_discard_root);
+	kmem_cache_free(ext4_free_ext_cachep, b);
+	return 1;
+}
+
+static void ext4_queue_discard(struct super_block *sb,
+			       struct ext4_free_data *entry)
+{
+	struct ext4_sb_info *sbi = EXT4_SB(sb);
+	struct rb_node **n = &sbi->s_discard_root.rb_node, *parent = NULL;
+	struct ext4_free_data *ex;
+
+	spin_lock(&sbi->s_discard_lock);
+	while (*n) {
+		parent = *n;
+		ex = rb_entry(parent, struct ext4_free_data, node);
+		if (entry->group < ex->group ||
+		    (entry->group == ex->group &&
+		     entry->start_blk < ex->start_blk))
+			n = &(*n)->rb_left;
+		else
+			n = &(*n)->rb_right;
+	}
+	rb_link_node(&entry->node, parent, n);
+	rb_insert_color(&entry->node, &sbi->s_discard_root);
+	sbi->s_discard_pending_extents++;
+	sbi->s_discard_pending_blocks += entry->count;
+
+	parent = rb_prev(&entry->node);
+	if (parent) {
+		ex = rb_entry(parent, struct ext4_free_data, node);
+		if (ext4_discard_try_merge(sbi, ex, entry))
+			entry = ex;
+	}
+	while ((parent = rb_next(&entry->node))) {
+		ex = rb_entry(parent, struct ext4_free_data, node);
+		if (!ext4_discard_try_merge(sbi, entry, ex))
+			break;
+	}
+	spin_unlock(&sbi->s_discard_lock);
+
+	queue_delayed_work(system_nrt_wq, &sbi->s_discard_work,
+			   ext4_discard_delay(sbi));
+}
+
+/*
+ * On eMMC a discard stalls everything queued behind it, so only issue
+ * one when no request is allocated on the device.
+ */
+static int ext4_discard_device_idle(struct super_block *sb)
+{
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+
+	return !q->rq.count[BLK_RW_SYNC] && !q->rq.count[BLK_RW_ASYNC];
+}
+
+static void ext4_discard_work(struct work_struct *work)
+{
+	struct ext4_sb_info *sbi = container_of(to_delayed_work(work),
+					struct ext4_sb_info, s_discard_work);
+	struct super_block *sb = sbi->s_buddy_cache->i_sb;
+	unsigned int budget = sbi->s_discard_max_blocks;
+	struct ext4_free_data *entry;
+	ext4_group_t group;
+	ext4_grpblk_t start, len, cnt;
+
+	while (budget && ext4_discard_device_idle(sb)) {
+		spin_lock(&sbi->s_discard_lock);
+		if (RB_EMPTY_ROOT(&sbi->s_discard_root)) {
+			spin_unlock(&sbi->s_discard_lock);
+			return;
+		}
+		entry = rb_entry(rb_first(&sbi->s_discard_root),
+				 struct ext4_free_data, node);
+		group = entry->group;
+		start = entry->start_blk;
+		len = min_t(unsigned int, entry->count, budget);
+		if (len == entry->count) {
+			rb_erase(&entry->node, &sbi->s_discard_root);
+			sbi->s_discard_pending_extents--;
+			kmem_cache_free(ext4_free_ext_cachep, entry);
+		} else {
+			entry->start_blk += len;
+			entry->count -= len;
+		}
+		sbi->s_discard_pending_blocks -= len;
+		spin_unlock(&sbi->s_discard_lock);
+
+		cnt = ext4_trim_all_free(sb, group, start, start + len, 1);
+		if (cnt > 0) {
+			sbi->s_discard_issued_extents++;
+			sbi->s_discard_issued_blocks += cnt;
+		}
+		budget -= len;
+	}
+
+	queue_delayed_work(system_nrt_wq, &sbi->s_discard_work,
+			   ext4_discard_delay(sbi));
+}
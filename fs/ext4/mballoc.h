@@ -94,6 +94,20 @@ extern u8 mb_enable_debug;
  */
 #define MB_DEFAULT_GROUP_PREALLOC	512
 
+/*
+ * with the discard mount option, freed extents are queued and discarded
+ * in the background every 1000ms, at most 16384 blocks per run
+ */
+#define MB_DEFAULT_DISCARD_INTERVAL	1000
+#define MB_DEFAULT_DISCARD_MAX_BLOCKS	16384
+
+/*
+ * at most this many extents wait for a background discard; beyond it,
+ * e.g. when the device is never idle, freed extents are discarded at
+ * commit time as without a discard interval
+ */
+#define MB_DISCARD_MAX_PENDING		8192
+
 
 struct ext4_free_data {
 	/* this links the free block information from group_info */
@@ -2481,6 +2481,20 @@ static ssize_t inode_readahead_blks_store(struct ext4_attr *a,
 	return count;
 }
 
+static ssize_t discard_max_blocks_store(struct ext4_attr *a,
+					struct ext4_sb_info *sbi,
+					const char *buf, size_t count)
+{
+	unsigned long t;
+
+	/* a run that may issue nothing would requeue itself forever */
+	if (parse_strtoul(buf, 0xffffffff, &t) || !t)
+		return -EINVAL;
+
+	sbi->s_discard_max_blocks = t;
+	return count;
+}
+
 static ssize_t sbi_ui_show(struct ext4_attr *a,
 			   struct ext4_sb_info *sbi, char *buf)
 {
@@ -2489,6 +2503,14 @@ static ssize_t sbi_ui_show(struct ext4_attr *a,
 	return snprintf(buf, PAGE_SIZE, "%u\n", *ui);
 }
 
+static ssize_t sbi_ul_show(struct ext4_attr *a,
+			   struct ext4_sb_info *sbi, char *buf)
+{
+	unsigned long *ul = (unsigned long *) (((char *) sbi) + a->offset);
+
+	return snprintf(buf, PAGE_SIZE, "%lu\n", *ul);
+}
+
 static ssize_t sbi_ui_store(struct ext4_attr *a,
 			    struct ext4_sb_info *sbi,
 			    const char *buf, size_t count)
@@ -2517,6 +2539,8 @@ static struct ext4_attr ext4_attr_##name = __ATTR(name, mode, show, store)
 #define EXT4_RW_ATTR(name) EXT4_ATTR(name, 0644, name##_show, name##_store)
 #define EXT4_RW_ATTR_SBI_UI(name, elname)	\
 	EXT4_ATTR_OFFSET(name, 0644, sbi_ui_show, sbi_ui_store, elname)
+#define EXT4_RO_ATTR_SBI_UL(name, elname)	\
+	EXT4_ATTR_OFFSET(name, 0444, sbi_ul_show, NULL, elname)
 #define ATTR_LIST(name) &ext4_attr_##name.attr
 
 EXT4_RO_ATTR(delayed_allocation_blocks);
@@ -2534,6 +2558,13 @@ EXT4_RW_ATTR_SBI_UI(mb_order2_req, s_mb_order2_reqs);
 EXT4_RW_ATTR_SBI_UI(mb_stream_req, s_mb_stream_request);
 EXT4_RW_ATTR_SBI_UI(mb_group_prealloc, s_mb_group_prealloc);
 EXT4_RW_ATTR_SBI_UI(max_writeback_mb_bump, s_max_writeback_mb_bump);
+EXT4_RW_ATTR_SBI_UI(discard_interval, s_discard_interval);
+EXT4_ATTR_OFFSET(discard_max_blocks, 0644, sbi_ui_show,
+		 discard_max_blocks_store, s_discard_max_blocks);
+EXT4_RO_ATTR_SBI_UL(discard_pending_extents, s_discard_pending_extents);
+EXT4_RO_ATTR_SBI_UL(discard_pending_blocks, s_discard_pending_blocks);
+EXT4_RO_ATTR_SBI_UL(discard_issued_extents, s_discard_issued_extents);
+EXT4_RO_ATTR_SBI_UL(discard_issued_blocks, s_discard_issued_blocks);
 
 static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(delayed_allocation_blocks),
@@ -2550,6 +2581,12 @@ static struct attribute *ext4_attrs[] = {
 	ATTR_LIST(mb_stream_req),
 	ATTR_LIST(mb_group_prealloc),
 	ATTR_LIST(max_writeback_mb_bump),
+	ATTR_LIST(discard_interval),
+	ATTR_LIST(discard_max_blocks),
+	ATTR_LIST(discard_pending_extents),
+	ATTR_LIST(discard_pending_blocks),
+	ATTR_LIST(discard_issued_extents),
+	ATTR_LIST(discard_issued_blocks),
 	NULL,
 };
 
@@ -2891,6 +2891,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	int did_gc = 0;
+	u32 gc_start = 0;
+	u32 stall;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2935,6 +2938,11 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 
 		dev->gc_skip = 5;
 
+		/* Foreground gc stalls the writer, time it */
+		if (!background && !did_gc)
+			gc_start = Y_TIME_US();
+		did_gc = 1;
+
 		/* If we don't already have a block being gc'd then see if we should start another */
 
 		if (dev->gc_block < 1 && !aggressive) {
@@ -2971,21 +2979,38 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	} while ((dev->n_erased_blocks < dev->param.n_reserved_blocks) &&
 		 (dev->gc_block > 0) && (max_tries < 2));
 
+	if (did_gc && !background) {
+		stall = Y_TIME_US() - gc_start;
+		dev->n_fg_gcs++;
+		dev->fg_gc_stall_us += stall;
+		if (stall > dev->fg_gc_max_stall_us)
+			dev->fg_gc_max_stall_us = stall;
+	}
+
 	return aggressive ? gc_ok : YAFFS_OK;
 }
 
+/* Passive gc only copies a few chunks per call, so urgent bg gc loops */
+#define YAFFS_BG_GC_URGENT_PASSES	8
+
 /*
  * yaffs_bg_gc()
  * Garbage collects. Intended to be called from a background thread.
+ * An urgency above 1 keeps going on the current block for a few passes.
  * Returns non-zero if at least half the free chunks are erased.
  */
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 {
-	int erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
+	int passes = (urgency > 1) ? YAFFS_BG_GC_URGENT_PASSES : 1;
+	int erased_chunks;
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
-	yaffs_check_gc(dev, 1);
+	do {
+		yaffs_check_gc(dev, 1);
+	} while (--passes > 0 && dev->gc_block > 0);
+
+	erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
@@ -3627,6 +3652,99 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 	return n_done;
 }
 
+/*
+ * Variant of yaffs_file_rd() for callers holding the device lock shared,
+ * so that reads of different objects can run in parallel.
+ *
+ * Only the tnode tree and the short op cache are looked at; both are only
+ * changed with the lock held exclusively. Data is read through the driver
+ * without tags, so no shared device buffers are used. If the exclusive
+ * path is needed (no reentrant driver reads, chunk groups that have to be
+ * resolved by reading tags, or any read error or ECC event that has to be
+ * handled), -EAGAIN is returned and the caller retries with yaffs_file_rd()
+ * under the exclusive lock.
+ */
+int yaffs_file_rd_shared(struct yaffs_obj *in, u8 * buffer, loff_t offset,
+			 int n_bytes)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	u8 *chunk_buffer = NULL;
+	u8 *dst;
+	int chunk;
+	int nand_chunk;
+	u32 start;
+	int n_copy;
+	int n_done = 0;
+	int ret_val = 0;
+
+	if (!dev->param.concurrent_reads || !dev->param.read_chunk_tags_fn ||
+	    dev->param.inband_tags || dev->chunk_grp_size != 1) {
+		dev->n_shared_rd_fallbacks++;
+		return -EAGAIN;
+	}
+
+	while (n_bytes > 0) {
+		yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+		chunk++;
+
+		if ((start + n_bytes) < dev->data_bytes_per_chunk)
+			n_copy = n_bytes;
+		else
+			n_copy = dev->data_bytes_per_chunk - start;
+
+		cache = yaffs_find_chunk_cache(in, chunk);
+		if (cache) {
+			memcpy(buffer, &cache->data[start], n_copy);
+			goto next;
+		}
+
+		/* With a chunk group size of 1 this does not touch the flash */
+		nand_chunk = yaffs_find_chunk_in_file(in, chunk, NULL);
+		if (nand_chunk < 0) {
+			memset(buffer, 0, n_copy);
+			goto next;
+		}
+
+		if (n_copy == dev->data_bytes_per_chunk) {
+			dst = buffer;
+		} else {
+			if (!chunk_buffer)
+				chunk_buffer =
+				    kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
+			if (!chunk_buffer) {
+				ret_val = -EAGAIN;
+				break;
+			}
+			dst = chunk_buffer;
+		}
+
+		dev->n_page_reads++;
+		if (dev->param.read_chunk_tags_fn(dev,
+						  nand_chunk - dev->chunk_offset,
+						  dst, NULL) != YAFFS_OK) {
+			ret_val = -EAGAIN;
+			break;
+		}
+		if (dst != buffer)
+			memcpy(buffer, &dst[start], n_copy);
+next:
+		n_bytes -= n_copy;
+		offset += n_copy;
+		buffer += n_copy;
+		n_done += n_copy;
+	}
+
+	kfree(chunk_buffer);
+
+	if (ret_val) {
+		dev->n_shared_rd_fallbacks++;
+		return ret_val;
+	}
+	dev->n_shared_reads++;
+	return n_done;
+}
+
 int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 		     int n_bytes, int write_trhrough)
 {
@@ -4916,6 +5034,9 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
+	dev->n_fg_gcs = 0;
+	dev->fg_gc_stall_us = 0;
+	dev->fg_gc_max_stall_us = 0;
 	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
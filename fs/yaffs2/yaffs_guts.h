@@ -524,6 +524,9 @@ struct yaffs_param {
 
 	int enable_xattr;	/* Enable xattribs */
 
+	int concurrent_reads;	/* read_chunk_tags_fn can read data without tags
+				 * from several threads at once */
+
 	/* NAND access functions (Must be set before calling YAFFS) */
 
 	int (*write_chunk_fn) (struct yaffs_dev * dev,
@@ -734,6 +737,11 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 n_shared_reads;
+	u32 n_shared_rd_fallbacks;
+	u32 n_fg_gcs;		/* gc passes run inline on the write path */
+	u64 fg_gc_stall_us;	/* time writers spent in them */
+	u32 fg_gc_max_stall_us;
 
 };
 
@@ -801,6 +809,8 @@ int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 /* File operations */
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
+int yaffs_file_rd_shared(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
+			 int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
 		  int n_bytes, int write_trhrough);
 int yaffs_resize_file(struct yaffs_obj *obj, loff_t new_size);
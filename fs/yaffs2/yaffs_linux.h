@@ -24,7 +24,9 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	u32 bg_gc_hard_runs;	/* bg gc passes below the hard threshold */
+	u32 bg_gc_soft_runs;	/* bg gc passes below the soft threshold */
+	struct rw_semaphore gross_lock;	/* Gross lock, shared by concurrent readers */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
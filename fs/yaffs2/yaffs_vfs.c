@@ -98,12 +98,25 @@ unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
 
+/*
+ * Background gc keeps a reserve of erased blocks so that writers do not
+ * have to collect inline. Below yaffs_bg_gc_hard erased blocks it collects
+ * right away; below yaffs_bg_gc_soft only once no page has been written
+ * for yaffs_bg_gc_idle_ms.
+ */
+unsigned int yaffs_bg_gc_soft = 24;
+unsigned int yaffs_bg_gc_hard = 10;
+unsigned int yaffs_bg_gc_idle_ms = 500;
+
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_gc_soft, uint, 0644);
+module_param(yaffs_bg_gc_hard, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -124,14 +137,31 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * The gross lock taken shared. Only good for yaffs_file_rd_shared(), every
+ * other yaffs_guts call still needs the lock held exclusively.
+ */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -1120,9 +1150,16 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 {
 	struct super_block *sb = yaffs_dev_to_lc(dev)->super;
 
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_touch_super() sb = %p", sb);
 	if (sb)
 		sb->s_dirt = 1;
+
+	/* Get the background thread to top up the erased block reserve */
+	if (context->bg_thread && yaffs_bg_enable &&
+	    dev->n_erased_blocks < yaffs_bg_gc_hard)
+		wake_up_process(context->bg_thread);
 }
 
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
@@ -1149,12 +1186,23 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+	ret = yaffs_file_rd_shared(obj, pg_buf,
+				   pg->index << PAGE_CACHE_SHIFT,
+				   PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
+
+	if (ret == -EAGAIN) {
+		yaffs_gross_lock(dev);
+
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
+
+		yaffs_gross_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -1546,7 +1594,18 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
-static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
+/*
+ * The erased block reserve can never exceed the free space, so the
+ * thresholds are capped by the number of free blocks.
+ */
+static unsigned yaffs_bg_gc_target(struct yaffs_dev *dev, unsigned threshold)
+{
+	unsigned free_blocks = dev->n_free_chunks / dev->param.chunks_per_block;
+
+	return min(threshold, free_blocks);
+}
+
+static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev, int idle)
 {
 	unsigned erased_chunks =
 	    dev->n_erased_blocks * dev->param.chunks_per_block;
@@ -1558,6 +1617,12 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 
 	if (!context->bg_running)
 		return 0;
+	else if (dev->n_erased_blocks <
+		 yaffs_bg_gc_target(dev, yaffs_bg_gc_hard))
+		return 2;
+	else if (idle && dev->n_erased_blocks <
+		 yaffs_bg_gc_target(dev, yaffs_bg_gc_soft))
+		return 1;
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
 	else if (erased_chunks > dev->n_free_chunks / 2)
@@ -1573,7 +1638,7 @@ static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 
 	struct yaffs_dev *dev = yaffs_super_to_dev(sb);
 	unsigned int oneshot_checkpoint = (yaffs_auto_checkpoint & 4);
-	unsigned gc_urgent = yaffs_bg_gc_urgency(dev);
+	unsigned gc_urgent = yaffs_bg_gc_urgency(dev, 0);
 	int do_checkpoint;
 
 	yaffs_trace(YAFFS_TRACE_OS | YAFFS_TRACE_SYNC | YAFFS_TRACE_BACKGROUND,
@@ -1622,8 +1687,14 @@ static int yaffs_bg_thread_fn(void *data)
 	unsigned long now = jiffies;
 	unsigned long next_dir_update = now;
 	unsigned long next_gc = now;
+	unsigned long last_active = now;
+	unsigned long gc_backoff = now;
+	unsigned long idle_time;
 	unsigned long expires;
 	unsigned int urgency;
+	u32 last_writes = 0;
+	int erased;
+	int idle;
 
 	int gc_result;
 	struct timer_list timer;
@@ -1650,14 +1721,40 @@ static int yaffs_bg_thread_fn(void *data)
 			next_dir_update = now + HZ;
 		}
 
-		if (time_after(now, next_gc) && yaffs_bg_enable) {
+		/* Page writes we did not do ourselves mean the fs is busy */
+		idle_time = msecs_to_jiffies(yaffs_bg_gc_idle_ms);
+		if (dev->n_page_writes != last_writes)
+			last_active = now;
+		idle = time_after_eq(now, last_active + idle_time);
+
+		if (dev->n_erased_blocks <
+		    yaffs_bg_gc_target(dev, yaffs_bg_gc_hard) &&
+		    time_after_eq(now, gc_backoff))
+			next_gc = now;
+
+		if (time_after_eq(now, next_gc) && yaffs_bg_enable) {
 			if (!dev->is_checkpointed) {
-				urgency = yaffs_bg_gc_urgency(dev);
+				urgency = yaffs_bg_gc_urgency(dev, idle);
+				erased = dev->n_erased_blocks;
 				gc_result = yaffs_bg_gc(dev, urgency);
 				if (urgency > 1)
-					next_gc = now + HZ / 20 + 1;
+					context->bg_gc_hard_runs++;
+				else if (urgency > 0)
+					context->bg_gc_soft_runs++;
+
+				if (urgency > 0 && dev->gc_block < 1 &&
+				    dev->n_erased_blocks <= erased) {
+					/* nothing worth collecting, back off */
+					gc_backoff = now + HZ;
+					next_gc = gc_backoff;
+				} else if (urgency > 1)
+					next_gc = now + 1;
 				else if (urgency > 0)
 					next_gc = now + HZ / 10 + 1;
+				else if (!idle && dev->n_erased_blocks <
+					 yaffs_bg_gc_target(dev, yaffs_bg_gc_soft))
+					/* recheck once the writers may have gone quiet */
+					next_gc = last_active + idle_time + 1;
 				else
 					next_gc = now + HZ * 2;
 			} else	{
@@ -1668,6 +1765,7 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
+		last_writes = dev->n_page_writes;
 		yaffs_gross_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
@@ -2268,6 +2366,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
+		param->concurrent_reads = 1;
 		param->total_bytes_per_chunk = mtd->writesize;
 		param->chunks_per_block = mtd->erasesize / mtd->writesize;
 		n_blocks = YCALCBLOCKS(mtd->size, mtd->erasesize);
@@ -2323,7 +2422,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -2477,6 +2576,19 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 		    dev->oldest_dirty_gc_count);
 	buf += sprintf(buf, "n_gc_blocks........... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs................ %u\n", dev->bg_gcs);
+	buf +=
+	    sprintf(buf, "bg_gc_hard_runs....... %u\n",
+		    yaffs_dev_to_lc(dev)->bg_gc_hard_runs);
+	buf +=
+	    sprintf(buf, "bg_gc_soft_runs....... %u\n",
+		    yaffs_dev_to_lc(dev)->bg_gc_soft_runs);
+	buf += sprintf(buf, "n_fg_gcs.............. %u\n", dev->n_fg_gcs);
+	buf +=
+	    sprintf(buf, "fg_gc_stall_us........ %llu\n",
+		    (unsigned long long)dev->fg_gc_stall_us);
+	buf +=
+	    sprintf(buf, "fg_gc_max_stall_us.... %u\n",
+		    dev->fg_gc_max_stall_us);
 	buf +=
 	    sprintf(buf, "n_retired_writes...... %u\n", dev->n_retired_writes);
 	buf +=
@@ -2489,6 +2601,10 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "n_shared_reads........ %u\n", dev->n_shared_reads);
+	buf +=
+	    sprintf(buf, "n_shared_rd_fallbacks. %u\n",
+		    dev->n_shared_rd_fallbacks);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
@@ -123,7 +123,7 @@ struct request {
 	struct gendisk *rq_disk;
 	struct hd_struct *part;
 	unsigned long start_time;
-#ifdef CONFIG_BLK_CGROUP
+#if defined(CONFIG_BLK_CGROUP) || defined(CONFIG_BLK_DEV_LATENCY_HIST)
 	unsigned long long start_time_ns;
 	unsigned long long io_start_time_ns;    /* when passed to hardware */
 #endif
@@ -260,6 +260,19 @@ struct queue_limits {
 	unsigned char		discard_zeroes_data;
 };
 
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+/*
+ * Bucket 0 counts requests that took less than 1us, bucket n those that
+ * took [2^(n-1), 2^n) us. The last bucket also takes everything slower.
+ */
+#define BLK_LAT_HIST_BUCKETS	26
+
+struct blk_latency_hist {
+	unsigned long	wait[2][BLK_LAT_HIST_BUCKETS];	/* queued -> dispatched */
+	unsigned long	service[2][BLK_LAT_HIST_BUCKETS]; /* dispatched -> done */
+};
+#endif
+
 struct request_queue
 {
 	/*
@@ -383,6 +396,10 @@ struct request_queue
 	/* Throttle data */
 	struct throtl_data *td;
 #endif
+#ifdef CONFIG_BLK_DEV_LATENCY_HIST
+	/* protected by queue_lock */
+	struct blk_latency_hist	latency_hist;
+#endif
 };
 
 #define QUEUE_FLAG_QUEUED	1	/* uses generic tag queueing */
@@ -1134,7 +1151,7 @@ static inline void put_dev_sector(Sector p)
 struct work_struct;
 int kblockd_schedule_work(struct request_queue *q, struct work_struct *work);
 
-#ifdef CONFIG_BLK_CGROUP
+#if defined(CONFIG_BLK_CGROUP) || defined(CONFIG_BLK_DEV_LATENCY_HIST)
 /*
  * This should not be using sched_clock(). A real patch is in progress
  * to fix this up, until that is in place we need to disable preemption
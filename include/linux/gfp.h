@@ -365,6 +365,14 @@ extern void free_hot_cold_page(struct page *page, int cold);
 void page_alloc_init(void);
 void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp);
 void drain_all_pages(void);
+
+#ifdef CONFIG_CMA
+/* The range must lie in MIGRATE_CMA pageblocks of a single zone. */
+extern int alloc_contig_range(unsigned long start, unsigned long end);
+extern void free_contig_range(unsigned long pfn, unsigned nr_pages);
+
+extern void init_cma_reserved_pageblock(struct page *page);
+#endif
 void drain_local_pages(void *dummy);
 
 extern gfp_t gfp_allowed_mask;
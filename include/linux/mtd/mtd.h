@@ -250,6 +250,8 @@ struct mtd_info {
 
 	/* Sync */
 	void (*sync) (struct mtd_info *mtd);
+	/* Like sync, but reports data that did not reach the medium */
+	int (*flush) (struct mtd_info *mtd);
 
 	/* Chip-supported device locking */
 	int (*lock) (struct mtd_info *mtd, loff_t ofs, uint64_t len);
@@ -52,6 +52,14 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Notified, in process context, when a new process is forked or the
+ * oom_adj of an existing one changes. Data is the thread group leader.
+ */
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_changed(struct task_struct *tsk);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
@@ -65,6 +65,42 @@ TRACE_EVENT(machine_suspend,
 	TP_printk("state=%lu", (unsigned long)__entry->state)
 );
 
+/*
+ * Emitted by closed-loop thermal controllers once per control period:
+ * the measured temperature, the power budget derived from it and the
+ * frequencies (kHz) that budget granted to the cpu, gpu and ddr clocks.
+ */
+TRACE_EVENT(thermal_power_allocate,
+
+	TP_PROTO(int temp, int target_temp, unsigned int budget,
+		 unsigned int cpu_freq, unsigned int gpu_freq,
+		 unsigned int ddr_freq),
+
+	TP_ARGS(temp, target_temp, budget, cpu_freq, gpu_freq, ddr_freq),
+
+	TP_STRUCT__entry(
+		__field(	int,		temp		)
+		__field(	int,		target_temp	)
+		__field(	u32,		budget		)
+		__field(	u32,		cpu_freq	)
+		__field(	u32,		gpu_freq	)
+		__field(	u32,		ddr_freq	)
+	),
+
+	TP_fast_assign(
+		__entry->temp = temp;
+		__entry->target_temp = target_temp;
+		__entry->budget = budget;
+		__entry->cpu_freq = cpu_freq;
+		__entry->gpu_freq = gpu_freq;
+		__entry->ddr_freq = ddr_freq;
+	),
+
+	TP_printk("temp=%d target=%d budget=%umW cpu=%u gpu=%u ddr=%u",
+		__entry->temp, __entry->target_temp, __entry->budget,
+		__entry->cpu_freq, __entry->gpu_freq, __entry->ddr_freq)
+);
+
 /* This code will be removed after deprecation time exceeded (2.6.41) */
 #ifdef CONFIG_EVENT_POWER_TRACING_DEPRECATED
 
@@ -1543,6 +1543,10 @@ long do_fork(unsigned long clone_flags,
 		 */
 		p->flags &= ~PF_STARTING;
 
+		/* The child inherited its parent's oom_adj */
+		if (!(clone_flags & CLONE_THREAD))
+			oom_adj_changed(p);
+
 		wake_up_new_task(p);
 
 		tracehook_report_clone_complete(trace, regs,
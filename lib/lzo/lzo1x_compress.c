@@ -93,9 +93,22 @@ match:
 				}
 				*op++ = tt;
 			}
+#ifdef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+			while (t >= 4) {
+				COPY4(op, ii);
+				op += 4;
+				ii += 4;
+				t -= 4;
+			}
+			while (t > 0) {
+				*op++ = *ii++;
+				t--;
+			}
+#else
 			do {
 				*op++ = *ii++;
 			} while (--t > 0);
+#endif
 		}
 
 		ip += 3;
@@ -125,6 +138,13 @@ match:
 			end = in_end;
 			m = m_pos + M2_MAX_LEN + 1;
 
+#ifdef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+			while (end - ip >= 4 && get_unaligned((const u32 *)m)
+					== get_unaligned((const u32 *)ip)) {
+				m += 4;
+				ip += 4;
+			}
+#endif
 			while (ip < end && *m == *ip) {
 				m++;
 				ip++;
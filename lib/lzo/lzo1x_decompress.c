@@ -14,6 +14,7 @@
 #ifndef STATIC
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/string.h>
 #endif
 
 #include <asm/unaligned.h>
@@ -24,9 +25,6 @@
 #define HAVE_OP(x, op_end, op) ((size_t)(op_end - op) < (x))
 #define HAVE_LB(m_pos, out, op) (m_pos < out || m_pos >= op)
 
-#define COPY4(dst, src)	\
-		put_unaligned(get_unaligned((const u32 *)(src)), (u32 *)(dst))
-
 int lzo1x_decompress_safe(const unsigned char *in, size_t in_len,
 			unsigned char *out, size_t *out_len)
 {
@@ -72,6 +70,28 @@ int lzo1x_decompress_safe(const unsigned char *in, size_t in_len,
 		if (HAVE_IP(t + 4, ip_end, ip))
 			goto input_overrun;
 
+#ifdef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+		/*
+		 * Far from the end of both buffers, copy the run eight bytes
+		 * at a time.  The last copy may spill up to seven bytes past
+		 * the run; they stay inside the output buffer and are
+		 * overwritten by whatever is decoded next.
+		 */
+		if (!HAVE_OP(t + 3 + 7, op_end, op) &&
+				!HAVE_IP(t + 3 + 7, ip_end, ip)) {
+			unsigned char * const run_end = op + t + 3;
+
+			do {
+				COPY8(op, ip);
+				op += 8;
+				ip += 8;
+			} while (op < run_end);
+			ip -= op - run_end;
+			op = run_end;
+			goto first_literal_run;
+		}
+#endif
+
 		COPY4(op, ip);
 		op += 4;
 		ip += 4;
@@ -183,6 +203,31 @@ match:
 			if (HAVE_OP(t + 3 - 1, op_end, op))
 				goto output_overrun;
 
+#ifdef CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+			/*
+			 * Same for matches at least eight bytes back: each
+			 * copy only reads bytes that are already final.
+			 */
+			if ((op - m_pos) >= 8 &&
+					!HAVE_OP(t + 2 + 7, op_end, op)) {
+				unsigned char * const run_end = op + t + 2;
+
+				do {
+					COPY8(op, m_pos);
+					op += 8;
+					m_pos += 8;
+				} while (op < run_end);
+				op = run_end;
+				goto match_done;
+			}
+			/* a run of a single repeated byte */
+			if ((op - m_pos) == 1 && t >= 16) {
+				memset(op, *m_pos, t + 2);
+				op += t + 2;
+				goto match_done;
+			}
+#endif
+
 			if (t >= 2 * 4 - (3 - 1) && (op - m_pos) >= 4) {
 				COPY4(op, m_pos);
 				op += 4;
@@ -0,0 +1,239 @@
+/*
+ * Round-trip and time lzo1x_1_compress() and lzo1x_decompress_safe().
+ *
+ * Every input is compressed and decompressed one 4KB page at a time, as
+ * zram does, and the result is compared with the original.  The module
+ * then prints MB/s (of uncompressed data) for both directions and the
+ * compression ratio, for each kind of input and for buffers that are
+ * aligned and misaligned by one byte.  Comparing the figures of kernels
+ * built with and without HAVE_EFFICIENT_UNALIGNED_ACCESS shows what the
+ * word-at-a-time paths in lib/lzo/ are worth.
+ *
+ * The module does its work at load time and always fails to load.  A
+ * round-trip mismatch is reported with WARN().
+ *
+ *	modprobe test-lzo [msec=200]
+ */
+#define pr_fmt(fmt) "test-lzo: " fmt
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/lzo.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#define TEST_LZO_PAGE	4096
+#define TEST_LZO_PAGES	64
+#define TEST_LZO_SIZE	(TEST_LZO_PAGE * TEST_LZO_PAGES)
+
+static unsigned int msec = 200;
+
+enum test_lzo_kind {
+	TEST_LZO_ZERO,
+	TEST_LZO_PATTERN,
+	TEST_LZO_TEXT,
+	TEST_LZO_MIXED,
+	TEST_LZO_RANDOM,
+};
+
+static const char * const test_lzo_kind_names[] = {
+	[TEST_LZO_ZERO]		= "zero",
+	[TEST_LZO_PATTERN]	= "pattern",
+	[TEST_LZO_TEXT]		= "text",
+	[TEST_LZO_MIXED]	= "mixed",
+	[TEST_LZO_RANDOM]	= "random",
+};
+
+static const char * const test_lzo_words[] = {
+	"the ", "of ", "and ", "kernel ", "page ", "memory ", "struct ",
+	"return ", "if (", "0x", "int ", "const ", "static ", "->", "NULL",
+	"data ", "buffer ", "unsigned ", "long ", "\n\t", "= ", "; ",
+};
+
+struct test_lzo_buf {
+	unsigned char *src;	/* TEST_LZO_SIZE of input */
+	unsigned char *cmp;	/* one worst-case output per page */
+	size_t *cmp_len;
+	unsigned char *out;	/* TEST_LZO_SIZE of decompressed data */
+	void *wrkmem;
+};
+
+static void __init test_lzo_fill(unsigned char *p, enum test_lzo_kind kind)
+{
+	size_t i, n;
+
+	switch (kind) {
+	case TEST_LZO_ZERO:
+		memset(p, 0, TEST_LZO_SIZE);
+		break;
+	case TEST_LZO_PATTERN:
+		for (i = 0; i < TEST_LZO_SIZE; i++)
+			p[i] = "abcdefg"[i % 7];
+		break;
+	case TEST_LZO_TEXT:
+		for (i = 0; i < TEST_LZO_SIZE; i += n) {
+			const char *w;
+
+			w = test_lzo_words[random32() %
+					   ARRAY_SIZE(test_lzo_words)];
+			n = min(strlen(w), TEST_LZO_SIZE - i);
+			memcpy(p + i, w, n);
+		}
+		break;
+	case TEST_LZO_MIXED:
+		test_lzo_fill(p, TEST_LZO_TEXT);
+		for (i = 0; i < TEST_LZO_SIZE; i += 2 * TEST_LZO_PAGE / 8)
+			get_random_bytes(p + i, TEST_LZO_PAGE / 8);
+		break;
+	case TEST_LZO_RANDOM:
+		get_random_bytes(p, TEST_LZO_SIZE);
+		break;
+	}
+}
+
+static int __init test_lzo_compress(struct test_lzo_buf *b, size_t off)
+{
+	size_t stride = lzo1x_worst_compress(TEST_LZO_PAGE) + 1;
+	int i, ret;
+
+	for (i = 0; i < TEST_LZO_PAGES; i++) {
+		ret = lzo1x_1_compress(b->src + off + i * TEST_LZO_PAGE,
+				       TEST_LZO_PAGE,
+				       b->cmp + off + i * stride,
+				       &b->cmp_len[i], b->wrkmem);
+		if (ret != LZO_E_OK)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int __init test_lzo_decompress(struct test_lzo_buf *b, size_t off)
+{
+	size_t stride = lzo1x_worst_compress(TEST_LZO_PAGE) + 1;
+	size_t len;
+	int i, ret;
+
+	for (i = 0; i < TEST_LZO_PAGES; i++) {
+		len = TEST_LZO_PAGE;
+		ret = lzo1x_decompress_safe(b->cmp + off + i * stride,
+					    b->cmp_len[i],
+					    b->out + off + i * TEST_LZO_PAGE,
+					    &len);
+		if (ret != LZO_E_OK)
+			return ret;
+		if (len != TEST_LZO_PAGE)
+			return LZO_E_ERROR;
+	}
+
+	return 0;
+}
+
+/* Repeat fn for msec milliseconds and return MB/s of uncompressed data. */
+static unsigned long __init test_lzo_mbps(int (*fn)(struct test_lzo_buf *,
+						    size_t),
+					  struct test_lzo_buf *b, size_t off)
+{
+	u64 bytes = 0;
+	ktime_t start;
+	s64 ns;
+
+	start = ktime_get();
+	do {
+		if (fn(b, off))
+			return 0;
+		bytes += TEST_LZO_SIZE;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		cond_resched();
+	} while (ns < (s64)msec * NSEC_PER_MSEC);
+
+	return div64_u64(bytes * 1000, ns);
+}
+
+static int __init test_lzo_run(struct test_lzo_buf *b, enum test_lzo_kind kind,
+			       size_t off)
+{
+	unsigned long c_mbps, d_mbps;
+	size_t total = 0;
+	int i, ret;
+
+	test_lzo_fill(b->src + off, kind);
+
+	ret = test_lzo_compress(b, off);
+	if (ret) {
+		WARN(1, "%s+%zu: compression failed: %d\n",
+		     test_lzo_kind_names[kind], off, ret);
+		return -EINVAL;
+	}
+
+	memset(b->out, 0, TEST_LZO_SIZE + 1);
+	ret = test_lzo_decompress(b, off);
+	if (ret || memcmp(b->src + off, b->out + off, TEST_LZO_SIZE)) {
+		WARN(1, "%s+%zu: round trip failed: %d\n",
+		     test_lzo_kind_names[kind], off, ret);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < TEST_LZO_PAGES; i++)
+		total += b->cmp_len[i];
+
+	c_mbps = test_lzo_mbps(test_lzo_compress, b, off);
+	d_mbps = test_lzo_mbps(test_lzo_decompress, b, off);
+
+	pr_info("%-7s +%zu: %3zu%% of input, compress %4lu MB/s, decompress %4lu MB/s\n",
+		test_lzo_kind_names[kind], off, total * 100 / TEST_LZO_SIZE,
+		c_mbps, d_mbps);
+
+	return 0;
+}
+
+static int __init test_lzo_init(void)
+{
+	size_t stride = lzo1x_worst_compress(TEST_LZO_PAGE) + 1;
+	struct test_lzo_buf b;
+	int kind, err = 0;
+	size_t off;
+
+	b.src = vmalloc(TEST_LZO_SIZE + 1);
+	b.cmp = vmalloc(stride * TEST_LZO_PAGES + 1);
+	b.cmp_len = vmalloc(TEST_LZO_PAGES * sizeof(*b.cmp_len));
+	b.out = vmalloc(TEST_LZO_SIZE + 1);
+	b.wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!b.src || !b.cmp || !b.cmp_len || !b.out || !b.wrkmem) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	pr_info("%u pages per input, %u ms per figure\n", TEST_LZO_PAGES, msec);
+
+	for (kind = 0; kind < ARRAY_SIZE(test_lzo_kind_names); kind++) {
+		for (off = 0; off <= 1; off++) {
+			err = test_lzo_run(&b, kind, off);
+			if (err)
+				goto out;
+		}
+	}
+
+	/* All the work is done; don't stay loaded. */
+	err = -EAGAIN;
+out:
+	vfree(b.wrkmem);
+	vfree(b.out);
+	vfree(b.cmp_len);
+	vfree(b.cmp);
+	vfree(b.src);
+	return err;
+}
+module_init(test_lzo_init);
+
+module_param(msec, uint, 0);
+MODULE_PARM_DESC(msec, "Milliseconds spent on each figure (default 200)");
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZO round-trip test and throughput");
@@ -13,6 +13,7 @@
 #include <linux/types.h>
 #include <linux/rbtree.h>
 #include <linux/spinlock_types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/workqueue.h>
 
 /* Iface handling */
@@ -197,6 +198,17 @@ static inline uint64_t dc_sum_packets(struct data_counters *counters,
 		+ counters->bpc[set][direction][IFS_PROTO_OTHER].packets;
 }
 
+/*
+ * The packet path keeps its counters per cpu: it only ever adds to the
+ * slice of the cpu it runs on, with BHs disabled, so it needs no lock.
+ * Readers fold the nr_cpu_ids slices into one data_counters.
+ */
+struct data_counters_pcpu {
+	struct data_counters dc;
+	struct u64_stats_sync syncp;
+} ____cacheline_aligned_in_smp;
+
+void dc_fold(struct data_counters *sum, const struct data_counters_pcpu *pcpu);
 
 /* Generic X based nodes used as a base for rb_tree ops */
 struct tag_node {
@@ -206,12 +218,13 @@ struct tag_node {
 
 struct tag_stat {
 	struct tag_node tn;
-	struct data_counters counters;
 	/*
 	 * If this tag is acct_tag based, we need to count against the
 	 * matching parent uid_tag.
 	 */
-	struct data_counters *parent_counters;
+	struct data_counters_pcpu *parent_counters;
+	/* nr_cpu_ids slices, allocated along with the tag_stat */
+	struct data_counters_pcpu counters[0];
 };
 
 struct iface_stat {
@@ -222,7 +235,8 @@ struct iface_stat {
 	struct net_device *net_dev;
 
 	struct byte_packet_counters totals_via_dev[IFS_MAX_DIRECTIONS];
-	struct data_counters totals_via_skb;
+	/* nr_cpu_ids slices */
+	struct data_counters_pcpu *totals_via_skb;
 	/*
 	 * We keep the last_known, because some devices reset their counters
 	 * just before NETDEV_UP, while some will reset just before
@@ -238,7 +252,8 @@ struct iface_stat {
 	struct proc_dir_entry *proc_ptr;
 
 	struct rb_root tag_stat_tree;
-	spinlock_t tag_stat_list_lock;
+	/* Read-held by the packet path, write-held to add or remove entries */
+	rwlock_t tag_stat_list_lock;
 };
 
 /* This is needed to create proc_dir_entries from atomic context. */
@@ -255,6 +270,9 @@ struct iface_stat_work {
  */
 struct sock_tag {
 	struct rb_node sock_node;
+	/* in sock_tag_hash, for the lockless lookup done per packet */
+	struct hlist_node sock_hnode;
+	struct rcu_head rcu;
 	struct sock *sk;  /* Only used as a number, never dereferenced */
 	/* The socket is needed for sockfd_put() */
 	struct socket *socket;